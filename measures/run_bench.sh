@@ -1,104 +1,134 @@
 #!/usr/bin/env bash
 
-# EXE=../tsp
-# INPUT="../dj38.tsp"
-# SIZES=(17 18)
-# RESULTS="../results.csv"
-
-# # THREADS=(2 4 8 16 32 64 128 256)
-# # CUTOFFS=(3 4 5 6 7 8)
-
-# THREADS=(256)
-# CUTOFFS=(2 4 5 6 7 8)
-
-# RUNS=10
-
-# echo "file;size;threads;cutoff;T_seq;T_par;speedup;efficiency" > "$RESULTS"
-
-# for size in "${SIZES[@]}"; do
-#     for c in "${CUTOFFS[@]}"; do
-#         for t in "${THREADS[@]}"; do
-#             echo "Running: size=$size threads=$t cutoff=$c (x$RUNS)"
-
-#             for run in $(seq 1 $RUNS); do
-#                 echo -n "  => run $run ... "
-#                 $EXE "$INPUT" $size $t $c >> "$RESULTS"
-#                 echo "done"
-#             done
-#             echo
-#         done
-#     done
-# done
-
-# set -euo pipefail
-
-# BIN=./tsp
-# INSTANCE=dj38.tsp
-# GRAPH_SIZE=16
-# THREADS=256
-# RESULTS=results_budget.csv
-# RUNS=3
-
-# echo "file;size;threads;budget;run;time" > "$RESULTS"
-
-# for BUDGET in $(seq 25000 500 35000); do
-#  echo "Budget = ${BUDGET}"
-
-#  for RUN in $(seq 1 $RUNS); do
-#    LINE=$(${BIN} "${INSTANCE}" "${GRAPH_SIZE}" "${THREADS}" "${BUDGET}" | head -n 1)
-
-#    echo "${LINE}" >> "$RESULTS"
-#  done
-# done
-
-# echo "Fin des mesures !"
-
-
-# set -euo pipefail
-
-# BIN=./tsp
-# INSTANCE=dj38.tsp
-# GRAPH_SIZE=16
-# THREADS=1
-# BUDGET=1
-# RESULTS=results_budget.csv
-# RUNS=5
-
-# echo "file;size;threads;budget;run;time" > "$RESULTS"
-
-# echo "Exécution avec Budget fixe = ${BUDGET}"
-
-# for RUN in $(seq 1 $RUNS); do
-#     # Exécution du programme avec le budget de 35000
-#     LINE=$(${BIN} "${INSTANCE}" "${GRAPH_SIZE}" "${THREADS}" "${BUDGET}" | head -n 1)
-    
-#     echo "Run ${RUN} terminé"
-#     echo "${LINE}" >> "$RESULTS"
-# done
-
-# echo "Fin des mesures ! Les résultats sont dans ${RESULTS}"
+# Strong and weak scaling of tsp on generated instances (see src/tspgen.cpp).
+#   strong: one instance of STRONG_SIZE cities per kind, solved with every thread count;
+#           speedup = T(first thread count) / T(threads), efficiency = speedup / threads
+#           relative to the first thread count.
+#   weak:   WEAK_SIZE cities with the first thread count, one more city each time the
+#           threads double (about the work of the search times the threads). The work
+#           of a branch and bound does not grow by exactly that factor, so efficiency
+#           is the explored nodes per second per thread relative to the first count.
+# Each point is the median of RUNS runs. Every parameter can be set from the
+# environment, e.g. THREADS="1 2 4" RUNS=1 KINDS=uniform ./run_bench.sh
+#
+# Output, in OUT:
+#   runs.csv    mode;kind;size;threads;run;time;nodes;distance   every run
+#   strong.csv  kind;size;threads;time;speedup;efficiency
+#   weak.csv    kind;size;threads;time;nodes;throughput;efficiency
 
 set -euo pipefail
-
-BIN=../src/tsp
-INSTANCE=../cities-files-examples/dj38.tsp
-GRAPH_SIZE=14
-RUNS=3
-RESULTS=results_budget.csv
-
-THREADS_LIST=(2 4 8 16 32 64 128 192 256)
-
-echo "file;size;threads;budget;run;time;open;closed;path" > "$RESULTS"
-
-for THREADS in "${THREADS_LIST[@]}"; do
-  BUDGET=$((111 * THREADS))
-  echo "=== Threads=${THREADS} | Budget=${BUDGET} | Size=${GRAPH_SIZE} ==="
-
-  for RUN in $(seq 1 "$RUNS"); do
-    LINE="$(${BIN} "${INSTANCE}" "${GRAPH_SIZE}" "${THREADS}" "${BUDGET}" | head -n 1)"
-    echo "  Run ${RUN} terminé"
-    echo "${LINE}" >> "$RESULTS"
+cd "$(dirname "$0")"
+
+BIN=${BIN:-../src}
+KINDS=${KINDS:-"uniform clustered grid"}
+SEED=${SEED:-1}
+THREADS=${THREADS:-"1 2 4 8 16 32 64 128 192 256"}
+RUNS=${RUNS:-3}
+STRONG_SIZE=${STRONG_SIZE:-16}
+WEAK_SIZE=${WEAK_SIZE:-12}
+BUDGET=${BUDGET:-auto}       # max_splitted_tasks argument of tsp
+TSP_OPTIONS=${TSP_OPTIONS:-} # more tsp options, e.g. --reduce
+OUT=${OUT:-results}
+
+mkdir -p "$OUT/instances"
+RUNS_CSV="$OUT/runs.csv"
+echo "mode;kind;size;threads;run;time;nodes;distance" > "$RUNS_CSV"
+
+# Path of a generated instance, written with its binary cache the first time
+instance() {
+  local file="$OUT/instances/$1$2-$SEED.tsp"
+  [ -f "$file" ] || "$BIN/tspgen" "$1" "$2" "$SEED" -o "$file" --cache
+  echo "$file"
+}
+
+# One run appended to runs.csv: mode kind size threads run
+measure() {
+  local output line time distance nodes
+  output="$("$BIN/tsp" "$(instance "$2" "$3")" "$3" "$4" "$BUDGET" --stats $TSP_OPTIONS)"
+  line="$(echo "$output" | head -n 1)"
+  time="$(echo "$line" | cut -d ';' -f 5)"
+  distance="$(echo "$line" | sed 's/.*;\[\([0-9]*\):.*/\1/')"
+  nodes="$(echo "$output" | sed -n 's/^stats;nodes=\([0-9]*\);.*/\1/p')"
+  echo "$1;$2;$3;$4;$5;$time;$nodes;$distance" >> "$RUNS_CSV"
+  echo "  $1 $2 size=$3 threads=$4 run=$5: ${time}s"
+}
+
+log2() {
+  local n=$1 l=0
+  while [ "$n" -gt 1 ]; do
+    n=$((n / 2))
+    l=$((l + 1))
+  done
+  echo "$l"
+}
+
+FIRST=${THREADS%% *}
+for kind in $KINDS; do
+  for threads in $THREADS; do
+    for run in $(seq 1 "$RUNS"); do
+      measure strong "$kind" "$STRONG_SIZE" "$threads" "$run"
+    done
+  done
+  for threads in $THREADS; do
+    size=$((WEAK_SIZE + $(log2 "$threads") - $(log2 "$FIRST")))
+    for run in $(seq 1 "$RUNS"); do
+      measure weak "$kind" "$size" "$threads" "$run"
+    done
   done
 done
 
-echo "Fin des mesures ! Les résultats sont dans ${RESULTS}"
+# Medians per (mode, kind, size, threads), the reference being the first thread count
+# of each kind. A distance differing between runs of one instance is reported: every
+# run has to find the optimum.
+awk -F ';' -v strong="$OUT/strong.csv" -v weak="$OUT/weak.csv" '
+function median(list,    v, n, i, j, t) {
+  n = split(list, v, " ")
+  for (i = 2; i <= n; i++)
+    for (j = i; j > 1 && v[j - 1] + 0 > v[j] + 0; j--) {
+      t = v[j]; v[j] = v[j - 1]; v[j - 1] = t
+    }
+  return n % 2 ? v[(n + 1) / 2] : (v[n / 2] + v[n / 2 + 1]) / 2
+}
+NR > 1 {
+  key = $1 ";" $2 ";" $3 ";" $4
+  if (!(key in times))
+    order[++count] = key
+  times[key] = times[key] " " $6
+  rates[key] = rates[key] " " ($6 > 0 ? $7 / $6 : 0)
+  nodes[key] = nodes[key] " " $7
+  if (($2 ";" $3) in optimum && optimum[$2 ";" $3] != $8)
+    printf "warning: %s size %s: distance %s, %s before\n", $2, $3, $8, optimum[$2 ";" $3] > "/dev/stderr"
+  optimum[$2 ";" $3] = $8
+}
+END {
+  print "kind;size;threads;time;speedup;efficiency" > strong
+  print "kind;size;threads;time;nodes;throughput;efficiency" > weak
+  for (i = 1; i <= count; i++) {
+    split(order[i], k, ";")
+    t = median(times[order[i]])
+    if (k[1] == "strong") {
+      if (!(k[2] in t1)) { t1[k[2]] = t; p1[k[2]] = k[4] }
+      s = t > 0 ? t1[k[2]] / t : 0
+      printf "%s;%s;%s;%s;%.3f;%.3f\n", k[2], k[3], k[4], t, s, s * p1[k[2]] / k[4] > strong
+    } else {
+      r = median(rates[order[i]]) / k[4]
+      if (!(k[2] in r1)) r1[k[2]] = r
+      printf "%s;%s;%s;%s;%s;%.0f;%.3f\n", k[2], k[3], k[4], t, median(nodes[order[i]]), r * k[4], (r1[k[2]] > 0 ? r / r1[k[2]] : 0) > weak
+    }
+  }
+}' "$RUNS_CSV"
+
+table() {
+  if command -v column > /dev/null; then
+    column -t -s ';' "$1"
+  else
+    tr ';' '\t' < "$1"
+  fi
+}
+
+echo
+echo "Strong scaling ($OUT/strong.csv)"
+table "$OUT/strong.csv"
+echo
+echo "Weak scaling ($OUT/weak.csv)"
+table "$OUT/weak.csv"
@@ -1,21 +1,41 @@
 #include <iostream>
+#include <cstdlib>
+#include <algorithm>
+
 #include "intvecsorttask.hpp"
+#include "workstealing.hpp"
 
-int main()
+// Benchmark of the runners on a workload other than TSP: sorting random integers
+int main(int argc, char **argv)
 {
+	if (argc > 5)
+	{
+		std::cerr << "Usage: " << argv[0] << " [vector_size] [nb_threads] [max_splitted_tasks] [partition_depth]\n";
+		return 1;
+	}
+	int size = argc >= 2 ? std::atoi(argv[1]) : 10000000;
+	unsigned nb_threads = argc >= 3 ? std::max(1, std::atoi(argv[2])) : std::thread::hardware_concurrency();
+	size_t max_splitted_tasks = argc >= 4 ? std::max(1, std::atoi(argv[3])) : 4 * nb_threads;
+	int depth = argc >= 5 ? std::atoi(argv[4]) : 4;
+
 	IntVecSortTask iv1;
-	iv1.randomize(100);
+	iv1.randomize(size);
 	IntVecSortTask iv2 = iv1;
+	IntVecSortTask iv3 = iv1;
 
-	PartitionedTaskRunner rr(2);
-	rr.run(&iv1);
+	WorkStealingRunner wr(nb_threads, max_splitted_tasks);
+	wr.run(&iv1);
 
-	DirectTaskRunner sr;
-	sr.run(&iv2);
+	PartitionedTaskRunner rr(depth);
+	rr.run(&iv2);
 
-	std::cout << "partitioned: " << rr.duration() << " seconds" << std::endl;
-	std::cout << "result: " << iv1 << std::endl;
+	DirectTaskRunner sr;
+	sr.run(&iv3);
 
-	std::cout << "direct solver: " << sr.duration() << " seconds" << std::endl;
-	std::cout << "result: " << iv2 << std::endl;
+	bool sorted = iv1.result() == iv3.result() && iv2.result() == iv3.result();
+	std::cout << "size;threads;budget;T_ws;T_partitioned;T_direct;sorted\n"
+			  << size << ';' << nb_threads << ';' << max_splitted_tasks << ';'
+			  << wr.duration() << ';' << rr.duration() << ';' << sr.duration() << ';'
+			  << (sorted ? "yes" : "no") << '\n';
+	return sorted ? 0 : 2;
 }
@@ -1,14 +1,20 @@
+#pragma once
+
 #include <random>
 #include <vector>
 
 #include "task.hpp"
 
+// Quicksort as a fork-join workload: split() partitions around a pivot into the
+// smaller, equal and greater keys, merge() concatenates their sorted vectors
 class IntVecSortTask : public Task {
 
 private:
 	std::vector<int> _data;
 
 public:
+	static const size_t MIN_SPLIT_SIZE = 1 << 14; // below, std::sort is cheaper than a task
+
 	IntVecSortTask() {}
 	~IntVecSortTask() override = default;
 
@@ -27,39 +33,49 @@ public:
 
 	// Task interface implementation: split, merge, solve, write
 
-	int split(Task** partitions, int max) override {
-		if (_data.size() < 3 || max < 3) return 0;
+	int split(TaskCollection* collection) override {
+		if (_data.size() < MIN_SPLIT_SIZE) return 0;
+		// median of three, the data may already be partly sorted
+		int a = _data[0], b = _data[_data.size()/2], c = _data.back();
+		int pivot = std::max(std::min(a, b), std::min(std::max(a, b), c));
+		// three ways, the keys equal to the pivot being already in place: every
+		// child is smaller than the parent, or there is no split when all are equal
+		size_t less = 0, greater = 0;
+		for (int v : _data) {
+			less += v < pivot;
+			greater += v > pivot;
+		}
+		if (less == 0 && greater == 0) return 0;
 		IntVecSortTask* leftt = new IntVecSortTask();
+		IntVecSortTask* middlet = new IntVecSortTask();
 		IntVecSortTask* rightt = new IntVecSortTask();
 		std::vector<int>& left = leftt->_data;
 		std::vector<int>& right = rightt->_data;
-		int pivot = _data[0];
-		for (int i=1; i<_data.size(); i++) {
-			if (_data[i] < pivot)
-				left.push_back(_data[i]);
-			else
-				right.push_back(_data[i]);
+		left.reserve(less);
+		right.reserve(greater);
+		for (int v : _data) {
+			if (v < pivot)
+				left.push_back(v);
+			else if (v > pivot)
+				right.push_back(v);
 		}
-		if (right.size())
-			left.push_back(pivot);
-		else
-			right.push_back(pivot);
-		partitions[0] = leftt;
-		partitions[1] = rightt;
-		return 2;
+		middlet->_data.assign(_data.size() - less - greater, pivot);
+		_data.clear();
+		_data.shrink_to_fit();
+		collection->push(leftt);
+		collection->push(middlet);
+		collection->push(rightt);
+		return 3;
 	}
 
-	void merge(Task** p, int max) override {
+	void merge(TaskCollection* collection) override {
 		_data.clear();
-		for (int i=0; i<max; i++) {
-			IntVecSortTask *t = (IntVecSortTask *) p[i];
-			if (t) {
-				p[i] = nullptr;
-				for (int v : t->_data)
-					_data.push_back(v);
-				delete t;
-			}
+		for (int i=0; i<collection->size(); i++) {
+			IntVecSortTask *t = (IntVecSortTask *) (*collection)[i];
+			_data.insert(_data.end(), t->_data.begin(), t->_data.end());
 		}
+		while (collection->size())
+			delete collection->pop();
 	}
 
 	void solve() override {
@@ -67,7 +83,7 @@ public:
 	}
 
 	void write(std::ostream& os) const override {
-		for (int i=0; i<_data.size(); i++) {
+		for (size_t i=0; i<_data.size(); i++) {
 			if (i) os << ' ';
 			os << _data[i];
 		}
@@ -0,0 +1,225 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Counters of the calling thread between start() and stop(), read from perf_event_open.
+// Every event is opened on its own, so that an event the CPU or the kernel refuses is
+// only missing from the counts. When perf_event_open is denied altogether (paranoid
+// level, seccomp of a container), the software counts come from the thread CPU clock
+// and getrusage instead.
+class PerfCounters
+{
+public:
+    enum Event
+    {
+        CYCLES,
+        INSTRUCTIONS,
+        L1_MISSES,  // L1 data cache read misses
+        LLC_MISSES, // last level cache misses
+        BRANCH_MISSES,
+        TASK_CLOCK, // nanoseconds on a CPU
+        CONTEXT_SWITCHES,
+        PAGE_FAULTS,
+        EVENTS
+    };
+
+    // Where the counts come from, from the most to the least detailed
+    enum Source
+    {
+        NONE,
+        HARDWARE, // perf events, hardware ones included
+        SOFTWARE, // perf software events only
+        RUSAGE    // no perf events
+    };
+
+    struct Counts
+    {
+        Source source = NONE;
+        long value[EVENTS] = {};
+        bool counted[EVENTS] = {};
+
+        // Sum over threads: an event is counted when every thread counted it
+        Counts &operator+=(const Counts &other)
+        {
+            if (other.source == NONE)
+                return *this;
+            bool first = source == NONE;
+            source = first ? other.source : std::max(source, other.source);
+            for (int e = 0; e < EVENTS; ++e)
+            {
+                counted[e] = (first || counted[e]) && other.counted[e];
+                value[e] = counted[e] ? value[e] + other.value[e] : 0;
+            }
+            return *this;
+        }
+
+        // name=value fields separated by ;, na for the events not counted
+        void write(std::ostream &os) const
+        {
+            static const char *const names[EVENTS] = {"cycles", "instructions", "l1_misses", "llc_misses",
+                                                      "branch_misses", "task_clock", "context_switches", "page_faults"};
+            static const char *const sources[] = {"none", "hardware", "software", "rusage"};
+            os << "source=" << sources[source];
+            for (int e = 0; e < EVENTS; ++e)
+            {
+                os << ';' << names[e] << '=';
+                if (counted[e])
+                    os << value[e];
+                else
+                    os << "na";
+            }
+            os << ";ipc=";
+            if (counted[CYCLES] && counted[INSTRUCTIONS] && value[CYCLES] > 0)
+                os << static_cast<double>(value[INSTRUCTIONS]) / value[CYCLES];
+            else
+                os << "na";
+        }
+    };
+
+    PerfCounters()
+    {
+        for (int &fd : _fd)
+            fd = -1;
+    }
+
+    ~PerfCounters() { close(); }
+
+    PerfCounters(const PerfCounters &) = delete;
+    PerfCounters &operator=(const PerfCounters &) = delete;
+
+    // Open and enable the counters of the calling thread
+    void start()
+    {
+        close();
+        static const uint32_t types[EVENTS] = {PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE,
+                                               PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_SOFTWARE,
+                                               PERF_TYPE_SOFTWARE, PERF_TYPE_SOFTWARE};
+        static const uint64_t configs[EVENTS] = {
+            PERF_COUNT_HW_CPU_CYCLES,
+            PERF_COUNT_HW_INSTRUCTIONS,
+            PERF_COUNT_HW_CACHE_L1D | PERF_COUNT_HW_CACHE_OP_READ << 8 | PERF_COUNT_HW_CACHE_RESULT_MISS << 16,
+            PERF_COUNT_HW_CACHE_MISSES,
+            PERF_COUNT_HW_BRANCH_MISSES,
+            PERF_COUNT_SW_TASK_CLOCK,
+            PERF_COUNT_SW_CONTEXT_SWITCHES,
+            PERF_COUNT_SW_PAGE_FAULTS};
+        bool hardware = false, software = false;
+        for (int e = 0; e < EVENTS; ++e)
+        {
+            _fd[e] = open(types[e], configs[e]);
+            if (_fd[e] >= 0)
+                (types[e] == PERF_TYPE_SOFTWARE ? software : hardware) = true;
+        }
+        _source = hardware ? HARDWARE : software ? SOFTWARE : RUSAGE;
+        if (_source == RUSAGE)
+            _start = usage();
+        for (int fd : _fd)
+            if (fd >= 0)
+                ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+
+    // Counts since start(), to be called by the same thread
+    Counts stop()
+    {
+        Counts c;
+        c.source = _source;
+        if (_source == RUSAGE)
+        {
+            Counts end = usage();
+            for (int e = 0; e < EVENTS; ++e)
+            {
+                c.counted[e] = end.counted[e];
+                c.value[e] = end.value[e] - _start.value[e];
+            }
+        }
+        for (int e = 0; e < EVENTS; ++e)
+        {
+            if (_fd[e] < 0)
+                continue;
+            ioctl(_fd[e], PERF_EVENT_IOC_DISABLE, 0);
+            uint64_t data[3]; // value, time enabled, time running
+            if (::read(_fd[e], data, sizeof data) != sizeof data)
+                continue;
+            c.counted[e] = true;
+            // Scaled when the PMU was shared between more events than it has counters
+            c.value[e] = data[2] > 0 && data[2] < data[1] ? static_cast<long>(static_cast<double>(data[0]) * data[1] / data[2])
+                                                          : static_cast<long>(data[0]);
+        }
+        close();
+        return c;
+    }
+
+private:
+    int _fd[EVENTS];
+    Source _source = NONE;
+    Counts _start; // RUSAGE source only
+
+    // One event of the calling thread, created disabled. -1 when refused. Hardware events
+    // count user space only (allowed up to paranoid level 2); software ones also count in
+    // the kernel when allowed, where context switches and page faults happen.
+    static int open(uint32_t type, uint64_t config)
+    {
+        if (type == PERF_TYPE_SOFTWARE)
+        {
+            int fd = open(type, config, false);
+            if (fd >= 0)
+                return fd;
+        }
+        return open(type, config, true);
+    }
+
+    static int open(uint32_t type, uint64_t config, bool user_only)
+    {
+        perf_event_attr attr;
+        std::memset(&attr, 0, sizeof attr);
+        attr.size = sizeof attr;
+        attr.type = type;
+        attr.config = config;
+        attr.disabled = 1;
+        attr.exclude_kernel = user_only;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        return static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC));
+    }
+
+    void close()
+    {
+        for (int &fd : _fd)
+        {
+            if (fd >= 0)
+                ::close(fd);
+            fd = -1;
+        }
+    }
+
+    // Software counts of the calling thread without perf events
+    static Counts usage()
+    {
+        Counts c;
+        c.source = RUSAGE;
+        timespec ts;
+        if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) == 0)
+        {
+            c.counted[TASK_CLOCK] = true;
+            c.value[TASK_CLOCK] = ts.tv_sec * 1000000000L + ts.tv_nsec;
+        }
+        rusage ru;
+        if (getrusage(RUSAGE_THREAD, &ru) == 0)
+        {
+            c.counted[CONTEXT_SWITCHES] = c.counted[PAGE_FAULTS] = true;
+            c.value[CONTEXT_SWITCHES] = ru.ru_nvcsw + ru.ru_nivcsw;
+            c.value[PAGE_FAULTS] = ru.ru_minflt + ru.ru_majflt;
+        }
+        return c;
+    }
+};
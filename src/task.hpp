@@ -3,6 +3,7 @@
 #include <iostream>
 #include <chrono>
 #include <algorithm>
+#include <vector>
 
 class TaskCollection;
 
@@ -19,11 +20,24 @@ class TaskCollection;
 class Task
 {
 public:
+	// split() pushes the children into the collection and returns their number (0 when
+	// the task cannot be split). Once they are all solved, merge() receives the same
+	// collection, combines their results and deletes them.
 	virtual int split(TaskCollection *collection) = 0;
 	virtual void merge(TaskCollection *collection) = 0;
 	virtual void solve() = 0;
 	virtual void write(std::ostream &os) const = 0;
 	virtual ~Task() = default;
+
+	// Optional, for runners splitting the work while it runs: do at most `budget`
+	// units of work and return false when some remains, which donate() can then
+	// give away as a new task. By default the whole task is solved at once.
+	virtual bool resume(long budget)
+	{
+		solve();
+		return true;
+	}
+	virtual Task *donate() { return nullptr; }
 };
 
 class TaskCollection
@@ -36,15 +50,13 @@ public:
 	virtual void clear() = 0;
 };
 
-class TaskRunner
+// Duration of the last run of a runner
+class RunTimer
 {
 private:
 	std::chrono::time_point<std::chrono::high_resolution_clock> _start, _stop;
 
 public:
-	virtual void run(Task *t) = 0;
-	virtual ~TaskRunner() = default;
-
 	double duration() const
 	{
 		std::chrono::duration<double> diff = _stop - _start;
@@ -56,6 +68,13 @@ protected:
 	void stopTimer() { _stop = std::chrono::high_resolution_clock::now(); }
 };
 
+class TaskRunner : public RunTimer
+{
+public:
+	virtual void run(Task *t) = 0;
+	virtual ~TaskRunner() = default;
+};
+
 class DirectTaskRunner : public TaskRunner
 {
 public:
@@ -67,38 +86,61 @@ public:
 	}
 };
 
-// class PartitionedTaskRunner : public TaskRunner
-// {
-// private:
-// 	int _max;
-// 	void recurse(Task *t)
-// 	{
-// 		Task *partitions[_max];
-// 		for (int i = 0; i < _max; i++)
-// 			partitions[i] = 0;
-// 		int npart = t->split(partitions, _max);
-// 		if (npart)
-// 		{
-// 			for (int i = 0; i < npart; i++)
-// 				recurse(partitions[i]);
-// 			t->merge(partitions, npart);
-// 		}
-// 		else
-// 			t->solve();
-// 	}
-
-// 	PartitionedTaskRunner() {} // cannot use default constructor
+class SimpleTaskCollection : public TaskCollection
+{
+private:
+	std::vector<Task *> _data;
 
-// public:
-// 	PartitionedTaskRunner(int max) : _max(max) {}
-
-// 	virtual void run(Task *t) override
-// 	{
-// 		TaskRunner::startTimer();
-// 		recurse(t);
-// 		TaskRunner::stopTimer();
-// 	}
-// };
+public:
+	int size() const override { return static_cast<int>(_data.size()); }
+	Task *operator[](int i) override { return _data[static_cast<size_t>(i)]; }
+	void push(Task *t) override { _data.push_back(t); }
+	Task *pop() override
+	{
+		if (_data.empty())
+			return nullptr;
+		Task *t = _data.back();
+		_data.pop_back();
+		return t;
+	}
+	void clear() override
+	{
+		_data.clear();
+	}
+};
+
+// Sequential fork-join: split recursively down to _max levels, solve the leaves
+// and merge on the way back up
+class PartitionedTaskRunner : public TaskRunner
+{
+private:
+	int _max;
+	void recurse(Task *t, int depth)
+	{
+		SimpleTaskCollection partitions;
+		int npart = depth < _max ? t->split(&partitions) : 0;
+		if (npart)
+		{
+			for (int i = 0; i < npart; i++)
+				recurse(partitions[i], depth + 1);
+			t->merge(&partitions);
+		}
+		else
+			t->solve();
+	}
+
+	PartitionedTaskRunner() {} // cannot use default constructor
+
+public:
+	PartitionedTaskRunner(int max) : _max(max) {}
+
+	virtual void run(Task *t) override
+	{
+		TaskRunner::startTimer();
+		recurse(t, 0);
+		TaskRunner::stopTimer();
+	}
+};
 
 std::ostream &operator<<(std::ostream &os, const Task &t)
 {
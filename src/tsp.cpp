@@ -1,16 +1,71 @@
 #include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstdio>
 
 #include "tsptask.hpp"
 #include "workstealing.hpp"
+#include "tspinline.hpp"
+#include "tspautotune.hpp"
+#include "tspreduce.hpp"
+#include "tspheuristic.hpp"
+#include "tspportfolio.hpp"
+
+static int usage(const char *program)
+{
+	std::cerr << "Usage: " << program
+			  << " <file.tsp> [graph_size] [nb_threads] [max_splitted_tasks|auto] [options]\n"
+			  << "  auto               choose the budget and cutoff from probes, split dynamically\n"
+			  << "  --bound-refresh=K  reload the shared best bound every K nodes (default "
+			  << TSPContext::DEFAULT_BOUND_REFRESH << ")\n"
+			  << "  --stats            report explored nodes and those due to a stale bound\n"
+			  << "  --engine=E         inline: packed prefixes stored in the deques (default)\n"
+			  << "                     task: heap allocated TSPTasks through the Task interface\n"
+			  << "                     heuristic: 2-opt/Or-opt multi-start for big instances, not exact\n"
+			  << "  --kicks=N          heuristic: perturbations per thread (default size)\n"
+			  << "  --tt=MB            prune prefixes dominated by a table of MB megabytes\n"
+			  << "  --tt-depth=MIN:MAX path sizes using the table (default 4:size-2)\n"
+			  << "  --reduce[=STEPS]   drop the edges proven absent from optimal tours first\n"
+			  << "  --perf             count cycles, instructions, cache and branch misses per worker\n"
+			  << "  --portfolio[=LIST] race branching orders on groups of threads sharing the bound,\n"
+			  << "                     LIST among nearest,regret,farthest,random (default all),\n"
+			  << "                     not with auto, --tt or --perf\n";
+	return 1;
+}
 
 int main(int argc, char **argv)
 {
-	if (argc < 2 || argc > 5)
+	// Options (--name or --name=value) may appear anywhere, the other arguments are positional
+	std::map<std::string, std::string> options;
+	std::vector<char *> positional;
+	for (int i = 0; i < argc; i++)
 	{
-		std::cerr << "Usage: " << argv[0]
-				  << " <file.tsp> [graph_size] [nb_threads] [max_splitted_tasks]\n";
-		return 1;
+		std::string arg = argv[i];
+		if (i > 0 && arg.rfind("--", 0) == 0)
+		{
+			size_t eq = arg.find('=');
+			options[arg.substr(2, eq == std::string::npos ? std::string::npos : eq - 2)] =
+				eq == std::string::npos ? "" : arg.substr(eq + 1);
+		}
+		else
+			positional.push_back(argv[i]);
 	}
+	for (auto &option : options)
+		if (option.first != "bound-refresh" && option.first != "stats" && option.first != "engine" &&
+			option.first != "tt" && option.first != "tt-depth" && option.first != "reduce" &&
+			option.first != "kicks" && option.first != "perf" &&
+			option.first != "portfolio")
+			return usage(argv[0]);
+	argc = static_cast<int>(positional.size());
+	argv = positional.data();
+
+	if (argc < 2 || argc > 5)
+		return usage(argv[0]);
+	const std::string engine = options.count("engine") ? options["engine"] : "inline";
+	if (engine != "inline" && engine != "task" && engine != "heuristic")
+		return usage(argv[0]);
 
 	// Arguments management
 	const char *filename = argv[1];
@@ -28,7 +83,8 @@ int main(int argc, char **argv)
 	}
 
 	size_t max_splitted_tasks = 1;
-	if (argc >= 5)
+	const bool auto_tune = argc >= 5 && std::string(argv[4]) == "auto";
+	if (argc >= 5 && !auto_tune)
 	{
 		long long tmp = std::atoll(argv[4]);
 		if (tmp > 0)
@@ -37,12 +93,64 @@ int main(int argc, char **argv)
 			max_splitted_tasks = 1;
 	}
 
-	// Graph creation
-	TSPGraph graph(filename);
+	// Graph creation, without matrix for the heuristic: it only looks at close cities
+	TSPGraph graph(filename, engine == "heuristic" ? TSPGraph::Storage::Lazy : TSPGraph::Storage::Auto);
 	if (argc >= 3 && graph_size > 0)
 		graph.resize(graph_size); // permit to reduce the number of cities
 
-	TSPPath::setup(&graph);
+	if (engine == "heuristic")
+	{
+		long kicks = options.count("kicks") ? std::atol(options["kicks"].c_str()) : graph.size();
+		TSPHeuristicSolver solver(graph, nb_threads, kicks);
+		solver.run();
+		std::cout << filename << ';'
+				  << graph_size << ';'
+				  << nb_threads << ';'
+				  << max_splitted_tasks << ';'
+				  << solver.duration() << ';';
+		solver.write(std::cout);
+		std::cout << ";\n";
+		auto &hs = solver.stats();
+		std::cout << "heuristic;candidates=" << solver.candidates()
+				  << ";start_length=" << hs.start_length
+				  << ";kicks=" << hs.kicks
+				  << ";accepted=" << hs.accepted
+				  << ";two_opt=" << hs.two_opt_moves
+				  << ";or_opt=" << hs.or_opt_moves << '\n';
+		return 0;
+	}
+
+	TSPContext context(&graph); // with the kernel specialised for this size when one exists
+
+	if (options.count("bound-refresh"))
+		context.setBoundRefresh(std::atoi(options["bound-refresh"].c_str()));
+	const bool stats = options.count("stats");
+	context.setMeasure(stats);
+
+	// Dominance table, allocated and cleared before the timer
+	std::unique_ptr<TSPTranspositionTable> table;
+	if (options.count("tt"))
+	{
+		long mb = std::atol(options["tt"].c_str());
+		int min_size = 4, max_size = context.size() - 2;
+		if (options.count("tt-depth") && std::sscanf(options["tt-depth"].c_str(), "%d:%d", &min_size, &max_size) != 2)
+			return usage(argv[0]);
+		if (mb <= 0)
+			return usage(argv[0]);
+		table.reset(new TSPTranspositionTable((size_t)mb << 20, min_size, max_size));
+		context.setTable(table.get());
+	}
+
+	// Edge elimination, its time is added to the result
+	TSPReduction reduction{};
+	TSPCandidates candidates;
+	const bool reduce = options.count("reduce");
+	if (reduce)
+	{
+		int steps = options["reduce"].empty() ? TSPEdgeReducer::DEFAULT_ITERATIONS : std::atoi(options["reduce"].c_str());
+		reduction = TSPEdgeReducer::reduce(graph, candidates, steps);
+		context.setCandidates(&candidates);
+	}
 
 	// Sequential TSP
 	// TSPTask tsp_direct;
@@ -50,14 +158,64 @@ int main(int argc, char **argv)
 	// direct_runner.run(&tsp_direct);
 	// std::cout << "direct solver: " << tsp_direct.result() << " time: " << direct_runner.duration() << std::endl;
 
-	// WorkStealing
-	TSPTask tsp_ws;
-	WorkStealingRunner ws_runner(nb_threads, max_splitted_tasks);
-	ws_runner.run(&tsp_ws);
+	// Portfolio: the racers replace the engine, its budget and tuning, and run outside
+	// the workers counted by --perf
+	std::vector<TSPOrdering::Order> orders;
+	const bool portfolio = options.count("portfolio");
+	if (portfolio && (engine != "inline" || table || auto_tune || options.count("perf") ||
+					  !TSPPortfolio::parse(options["portfolio"].empty() ? "nearest,regret,farthest,random" : options["portfolio"], orders)))
+		return usage(argv[0]);
+
+	// Auto mode: the probes run before the timer, their time is added to the result
+	TSPTuning tuning{};
+	int cutoff_size = context.size();
+	if (auto_tune)
+	{
+		tuning = TSPAutoTuner::tune(context, nb_threads);
+		max_splitted_tasks = tuning.budget;
+		cutoff_size = tuning.cutoff_size;
+	}
 
-	double T_par = ws_runner.duration();
+	// WorkStealing
+	double T_par = tuning.probe_time + reduction.time;
+	long donations, steal_failures, slice;
+	const bool perf = options.count("perf");
+	PerfCounters::Counts counts;
+	std::unique_ptr<TSPPortfolio> racing;
+	if (portfolio)
+	{
+		racing.reset(new TSPPortfolio(context, nb_threads, orders));
+		racing->run();
+		T_par += racing->duration();
+		donations = steal_failures = slice = 0;
+	}
+	else if (engine == "task")
+	{
+		TSPTask tsp_ws(&context, cutoff_size);
+		WorkStealingRunner ws_runner(nb_threads, max_splitted_tasks);
+		ws_runner.setDynamicSplitting(auto_tune);
+		ws_runner.setPerfCounters(perf);
+		ws_runner.run(&tsp_ws);
+		T_par += ws_runner.duration();
+		donations = ws_runner.donations();
+		steal_failures = ws_runner.stealFailures();
+		slice = ws_runner.sliceLength();
+		counts = ws_runner.perfCounts();
+	}
+	else
+	{
+		TSPInlineRunner ws_runner(nb_threads, max_splitted_tasks, 1 << 20, TSPPrefixOps(&context, cutoff_size));
+		ws_runner.setDynamicSplitting(auto_tune);
+		ws_runner.setPerfCounters(perf);
+		ws_runner.run(context.root().prefix());
+		T_par += ws_runner.duration();
+		donations = ws_runner.donations();
+		steal_failures = ws_runner.stealFailures();
+		slice = ws_runner.sliceLength();
+		counts = ws_runner.perfCounts();
+	}
 
-	auto &r = tsp_ws.result();
+	auto &r = context.result();
 	std::cout << filename << ';'
 			  << graph_size << ';'
 			  << nb_threads << ';'
@@ -66,5 +224,59 @@ int main(int argc, char **argv)
 			  << r << ';'
 			  << '\n';
 
+	// Extra lines come after the result line, which run_bench.sh keeps with head -n 1
+	if (auto_tune)
+		std::cout << "autotune;estimated_nodes=" << tuning.estimated_nodes
+				  << ";budget=" << tuning.budget
+				  << ";cutoff_size=" << tuning.cutoff_size
+				  << ";probes=" << tuning.probes
+				  << ";probe_time=" << tuning.probe_time
+				  << ";donations=" << donations
+				  << ";steal_failures=" << steal_failures
+				  << ";slice=" << slice << '\n';
+	if (stats)
+		std::cout << "stats;nodes=" << context.nodes()
+				  << ";stale_nodes=" << context.staleNodes()
+				  << ";bound_refresh=" << context.boundRefresh() << '\n';
+	if (racing)
+	{
+		for (size_t i = 0; i < racing->racers().size(); i++)
+		{
+			const TSPPortfolio::Racer &racer = *racing->racers()[i];
+			const TSPOrdering &o = racer.ordering;
+			std::cout << "racer;" << i << ';' << TSPPortfolio::name(o.order)
+					  << ";threads=" << racer.threads
+					  << ";restarts=" << racer.restarts
+					  << ";improvements=" << o.improvements.load()
+					  << ";best=" << (o.found.load() == INT_MAX ? -1 : o.found.load())
+					  << ";found_at=" << (o.found_at.load() ? racing->since(o.found_at.load()) : -1) << '\n';
+		}
+		const int winner = racing->winner(), incumbent = racing->incumbent();
+		std::cout << "portfolio;winner=" << TSPPortfolio::name(racing->racers()[winner]->ordering.order)
+				  << ";incumbent=" << (incumbent < 0 ? "none" : TSPPortfolio::name(racing->racers()[incumbent]->ordering.order))
+				  << ";incumbent_time=" << (incumbent < 0 ? -1 : racing->since(racing->racers()[incumbent]->ordering.found_at.load()))
+				  << ";proof_time=" << racing->duration() << '\n';
+	}
+	if (perf)
+	{
+		std::cout << "perf;";
+		counts.write(std::cout);
+		std::cout << '\n';
+	}
+	if (reduce)
+		std::cout << "reduce;edges=" << reduction.edges
+				  << ";eliminated=" << reduction.eliminated
+				  << ";lower_bound=" << reduction.lower_bound
+				  << ";upper_bound=" << reduction.upper_bound
+				  << ";iterations=" << reduction.iterations
+				  << ";time=" << reduction.time << '\n';
+	if (table)
+		std::cout << "tt;memory=" << table->bytes()
+				  << ";entries=" << table->entries()
+				  << ";depth=" << table->minSize() << ':' << table->maxSize()
+				  << ";lookups=" << table->lookups()
+				  << ";hits=" << table->hits()
+				  << ";prunes=" << table->prunes() << '\n';
+
 	return 0;
 }
@@ -0,0 +1,105 @@
+#pragma once
+
+#include <chrono>
+#include <random>
+#include <vector>
+
+#include "tsptask.hpp"
+
+// Parameters chosen for a run by TSPAutoTuner::tune()
+struct TSPTuning
+{
+	double estimated_nodes; // size of the pruned search tree estimated by the probes
+	size_t budget;			// max_splitted_tasks given to WorkStealingRunner
+	int cutoff_size;		// tasks whose path is that long are not split any further
+	int probes;
+	double probe_time; // seconds
+};
+
+// Chooses the split budget and cutoff depth of a run from random probes of the search
+// tree (Knuth's estimator), pruned with the bound of a nearest-neighbour tour. The
+// remaining imbalance is left to the dynamic splitting of WorkStealingRunner.
+class TSPAutoTuner
+{
+public:
+	static const int DEFAULT_PROBES = 2000;
+	static const long MIN_TASK_NODES = 50000; // smaller tasks cost more to schedule than to solve
+	static const int TASKS_PER_THREAD = 64;	  // more is useless with dynamic splitting
+
+	static TSPTuning tune(const TSPContext &context, unsigned threads, int probes = DEFAULT_PROBES, unsigned seed = 1)
+	{
+		auto start = std::chrono::steady_clock::now();
+		TSPTuning t;
+		t.probes = probes;
+		t.estimated_nodes = estimate(context, probes, seed);
+
+		double tasks = t.estimated_nodes / MIN_TASK_NODES;
+		tasks = std::min(tasks, static_cast<double>(threads) * TASKS_PER_THREAD);
+		tasks = std::max(tasks, static_cast<double>(threads));
+		t.budget = threads > 1 ? static_cast<size_t>(tasks) : 1;
+
+		t.cutoff_size = cutoffFor(context.size(), t.budget);
+
+		std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+		t.probe_time = elapsed.count();
+		return t;
+	}
+
+	// Splitting level k gives (n-1)(n-2)...(n-k) tasks: the cutoff size stops at the
+	// first level reaching the budget
+	static int cutoffFor(int n, size_t budget)
+	{
+		double width = 1;
+		int k = 0;
+		while (width < budget && k < n - 1)
+			width *= n - 1 - k++;
+		return k + 1;
+	}
+
+private:
+	// Mean over the probes of the number of nodes of the tree below the root. Each probe
+	// follows one random branch and multiplies the branching factors along it.
+	static double estimate(const TSPContext &context, int probes, unsigned seed)
+	{
+		const int n = context.size();
+		const int bound = greedyTour(context);
+		std::mt19937 rng(seed);
+		double total = 0;
+		int children[TSPPath::MAX_GRAPH];
+		for (int p = 0; p < probes; ++p)
+		{
+			TSPPath path = context.root();
+			double weight = 1;
+			while (path.size() < n)
+			{
+				int m = 0;
+				for (int i = 0; i < n; ++i)
+					if (!path.contains(i) && context.candidate(path.tail(), i) && path.distance() + path.cost(i) < bound)
+						children[m++] = i;
+				if (m == 0)
+					break;
+				weight *= m;
+				total += weight;
+				path.push(children[std::uniform_int_distribution<int>(0, m - 1)(rng)]);
+			}
+		}
+		return probes ? total / probes : 0;
+	}
+
+	// Length of the nearest-neighbour tour, an upper bound of the optimum
+	static int greedyTour(const TSPContext &context)
+	{
+		const int n = context.size();
+		TSPPath path = context.root();
+		while (path.size() < n)
+		{
+			int next = -1;
+			for (int i = 0; i < n; ++i)
+				if (!path.contains(i) && (next < 0 || path.cost(i) < path.cost(next)))
+					next = i;
+			path.push(next);
+		}
+		path.push(TSPPath::FIRST_NODE);
+		return path.distance();
+	}
+};
@@ -0,0 +1,140 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+
+#include "tspservice.hpp"
+
+// Batch of solves on one pool: every line of the manifest is a job
+//     <file.tsp> [size|min-max] [deadline]
+// a min-max range giving one job per size. Each file is loaded once, the jobs run
+// concurrently, each one with its own context, and one line is printed per job as it
+// ends (see TSPService):
+//     id;name;size;status;queue_time;solve_time;latency;[path];
+// then a summary line. Empty lines and lines starting with # are ignored.
+
+static int usage(const char *program)
+{
+	std::cerr << "Usage: " << program << " <manifest> [nb_threads] [options]\n"
+			  << "  --jobs=N  jobs in progress at once (default 2 per thread)\n"
+			  << "  --reduce  eliminate edges by reduced cost before each solve\n";
+	return 1;
+}
+
+struct Job
+{
+	std::string file;
+	int size;
+	double deadline;
+};
+
+int main(int argc, char **argv)
+{
+	std::vector<char *> positional;
+	bool reduce = false;
+	long max_jobs = 0;
+	for (int i = 0; i < argc; i++)
+	{
+		std::string arg = argv[i];
+		if (i > 0 && arg == "--reduce")
+			reduce = true;
+		else if (i > 0 && arg.rfind("--jobs=", 0) == 0)
+			max_jobs = std::atol(arg.c_str() + 7);
+		else if (i > 0 && arg.rfind("--", 0) == 0)
+			return usage(argv[0]);
+		else
+			positional.push_back(argv[i]);
+	}
+	if (positional.size() < 2 || positional.size() > 3)
+		return usage(argv[0]);
+	unsigned nb_threads = std::thread::hardware_concurrency();
+	if (positional.size() >= 3)
+		nb_threads = std::max(1, std::atoi(positional[2]));
+	if (max_jobs <= 0)
+		max_jobs = 2 * nb_threads;
+
+	std::ifstream manifest(positional[1]);
+	if (!manifest)
+	{
+		std::cerr << "Cannot open manifest " << positional[1] << '\n';
+		return 1;
+	}
+	std::vector<Job> jobs;
+	std::string line;
+	for (int number = 1; std::getline(manifest, line); number++)
+	{
+		std::istringstream in(line);
+		std::string file, sizes = "0";
+		double deadline = 0;
+		if (!(in >> file) || file[0] == '#')
+			continue;
+		in >> sizes >> deadline;
+		int min_size = 0, max_size = 0;
+		char dash;
+		std::istringstream range(sizes);
+		range >> min_size;
+		max_size = (range >> dash >> max_size) ? max_size : min_size;
+		if (min_size < 0 || max_size < min_size)
+		{
+			std::cerr << "Invalid sizes at line " << number << ": " << sizes << '\n';
+			return 1;
+		}
+		for (int size = min_size; size <= max_size; size++)
+			jobs.push_back({file, size, deadline});
+	}
+
+	TSPService service(nb_threads, reduce);
+	std::mutex mutex; // output and count of the jobs in progress
+	std::condition_variable finished;
+	long in_progress = 0, errors = 0;
+	auto start = std::chrono::steady_clock::now();
+	for (const Job &job : jobs)
+	{
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			finished.wait(lock, [&]
+						  { return in_progress < max_jobs; });
+		}
+		try
+		{
+			auto graph = service.graph(job.file, job.size);
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				in_progress++;
+			}
+			service.solve(graph, job.deadline, [&](const TSPService::Result &r)
+						  {
+							  std::lock_guard<std::mutex> lock(mutex);
+							  std::cout << r << std::endl; // streamed as the jobs end
+							  in_progress--;
+							  finished.notify_one(); });
+		}
+		catch (const std::exception &e)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			std::cout << "error;" << job.file << ';' << job.size << ';' << e.what() << std::endl;
+			errors++;
+		}
+	}
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		finished.wait(lock, [&]
+					  { return in_progress == 0; });
+	}
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+	auto m = service.metrics();
+	std::cout << "batch;jobs=" << m.requests
+			  << ";errors=" << errors
+			  << ";time=" << elapsed.count()
+			  << ";mean_latency=" << (m.requests ? m.total_latency / m.requests : 0)
+			  << ";max_queue=" << m.max_queue
+			  << ";graphs=" << m.graphs
+			  << ";threads=" << service.threads() << '\n';
+	return errors ? 2 : 0;
+}
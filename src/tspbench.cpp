@@ -0,0 +1,50 @@
+#include <iostream>
+#include <cstdlib>
+
+#include "tsptask.hpp"
+
+// Micro-benchmark of the search kernels: for each graph size, the sequential solve
+// with the generic kernel against the kernel specialised for that size (best of runs).
+int main(int argc, char **argv)
+{
+	if (argc < 2 || argc > 5)
+	{
+		std::cerr << "Usage: " << argv[0] << " <file.tsp> [min_size] [max_size] [runs]\n";
+		return 1;
+	}
+	const int min_size = argc >= 3 ? std::atoi(argv[2]) : TSPTask::MIN_KERNEL;
+	const int max_size = argc >= 4 ? std::atoi(argv[3]) : min_size + 1;
+	const int runs = argc >= 5 ? std::max(1, std::atoi(argv[4])) : 3;
+
+	TSPGraph graph(argv[1]);
+	std::cout << "size;generic;specialised;speedup\n";
+	for (int size = min_size; size <= max_size && size <= graph.dimension(); size++)
+	{
+		graph.resize(size);
+		TSPContext context(&graph);
+
+		double times[2];
+		int dists[2];
+		for (int specialised = 0; specialised < 2; specialised++)
+		{
+			context.selectKernel(specialised ? size : 0);
+			times[specialised] = 1e30;
+			for (int run = 0; run < runs; run++)
+			{
+				context.reset(); // every run starts without bound
+				TSPTask task(&context);
+				DirectTaskRunner runner;
+				runner.run(&task);
+				times[specialised] = std::min(times[specialised], runner.duration());
+				dists[specialised] = task.result().distance();
+			}
+		}
+		if (dists[0] != dists[1])
+		{
+			std::cerr << "Kernels disagree for size " << size << ": " << dists[0] << " != " << dists[1] << '\n';
+			return 2;
+		}
+		std::cout << size << ';' << times[0] << ';' << times[1] << ';' << times[0] / times[1] << '\n';
+	}
+	return 0;
+}
@@ -0,0 +1,34 @@
+#include <iostream>
+#include <cstring>
+#include "tspgraph.hpp"
+
+// Precompute the binary cache (coordinates, distance matrix, sorted neighbour lists)
+// of each .tsp file, so that tsp can map it instead of parsing the text file.
+// With -v the matrix is also checked against the scalar euc2d.
+int main(int argc, char **argv)
+{
+	bool check = argc > 1 && std::strcmp(argv[1], "-v") == 0;
+	if (argc < 2 + check)
+	{
+		std::cerr << "Usage: " << argv[0] << " [-v] <file.tsp> [file.tsp ...]\n";
+		return 1;
+	}
+	int status = 0;
+	for (int i = 1 + check; i < argc; i++)
+	{
+		TSPGraph g(argv[i], TSPGraph::Storage::Matrix);
+		if (!g.cached()) // mapped: the cache matches the file
+			g.writeCache();
+		std::cout << TSPGraph::cachePath(argv[i]) << ": " << g.dimension() << " cities"
+				  << (g.cached() ? " (up to date)" : "");
+		if (check)
+		{
+			long errors = g.verify();
+			std::cout << ", " << errors << " distances differing from euc2d";
+			if (errors)
+				status = 2;
+		}
+		std::cout << '\n';
+	}
+	return status;
+}
@@ -0,0 +1,204 @@
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <list>
+#include <thread>
+#include <atomic>
+#include <csignal>
+#include <cstring>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "tspservice.hpp"
+
+// Resident solver on a Unix domain socket. Each line sent by a client is a request,
+// answered by one line:
+//     solve <file.tsp> [size] [deadline]     a file (loaded once), reduced to size cities
+//     coords <deadline> <x1> <y1> <x2> ...   inline coordinates
+//     stats                                  latency and queueing of the requests so far
+//     shutdown                               stop the daemon
+// A deadline is in seconds, 0 for none. A solve is answered by
+//     id;name;size;status;queue_time;solve_time;latency;[path];
+// the status being ok, or deadline when the search was cut (the path is then the best
+// one found so far), and an error by error;<message>.
+
+static int usage(const char *program)
+{
+	std::cerr << "Usage: " << program << " <socket> [nb_threads] [--reduce]\n"
+			  << "  --reduce  eliminate edges by reduced cost before each solve\n";
+	return 1;
+}
+
+static std::atomic<bool> stopping{false};
+static int listener = -1;
+
+static std::string answer(TSPService &service, const std::string &line)
+{
+	std::istringstream in(line);
+	std::string command;
+	in >> command;
+	std::ostringstream out;
+	try
+	{
+		if (command == "solve")
+		{
+			std::string file;
+			int size = 0;
+			double deadline = 0;
+			if (!(in >> file))
+				throw std::runtime_error("missing file");
+			in >> size >> deadline;
+			out << service.solve(service.graph(file, size), deadline);
+		}
+		else if (command == "coords")
+		{
+			double deadline = 0;
+			std::vector<double> xy;
+			in >> deadline;
+			for (double v; in >> v;)
+				xy.push_back(v);
+			if (xy.size() > 2 * (size_t)TSPPath::MAX_GRAPH)
+				throw std::runtime_error("Graph bigger than MAX_GRAPH");
+			out << service.solve(std::make_shared<TSPGraph>("coords", xy), deadline);
+		}
+		else if (command == "stats")
+		{
+			auto m = service.metrics();
+			out << "stats;requests=" << m.requests
+				<< ";mean_latency=" << (m.requests ? m.total_latency / m.requests : 0)
+				<< ";max_latency=" << m.max_latency
+				<< ";mean_queue=" << (m.requests ? m.total_queue / m.requests : 0)
+				<< ";max_queue=" << m.max_queue
+				<< ";graphs=" << m.graphs
+				<< ";threads=" << service.threads();
+		}
+		else if (command == "shutdown")
+		{
+			stopping.store(true);
+			::shutdown(listener, SHUT_RDWR); // wakes accept()
+			out << "shutdown";
+		}
+		else
+			throw std::runtime_error("unknown command " + command);
+	}
+	catch (const std::exception &e)
+	{
+		out.str("");
+		out << "error;" << e.what();
+	}
+	return out.str();
+}
+
+// A client served by its own thread. Only the main thread joins it and closes the
+// socket, so that it can still shut the socket down while the client is connected.
+struct Connection
+{
+	int socket;
+	std::thread thread;
+	std::atomic<bool> done{false};
+
+	explicit Connection(int s) : socket(s) {}
+};
+
+// Requests of one client are answered in order, clients are served concurrently
+static void serve(TSPService &service, Connection &connection)
+{
+	const int client = connection.socket;
+	std::string buffer;
+	char chunk[4096];
+	for (ssize_t n; (n = ::read(client, chunk, sizeof chunk)) > 0;)
+	{
+		buffer.append(chunk, n);
+		for (size_t eol; (eol = buffer.find('\n')) != std::string::npos;)
+		{
+			std::string line = buffer.substr(0, eol);
+			buffer.erase(0, eol + 1);
+			if (line.empty())
+				continue;
+			std::string reply = answer(service, line) + '\n';
+			if (::write(client, reply.data(), reply.size()) < 0)
+				break;
+		}
+	}
+	connection.done.store(true);
+}
+
+// Join the threads of the clients gone, or of every client with all
+static void reap(std::list<Connection> &connections, bool all)
+{
+	for (auto c = connections.begin(); c != connections.end();)
+		if (all || c->done.load())
+		{
+			c->thread.join();
+			::close(c->socket);
+			c = connections.erase(c);
+		}
+		else
+			++c;
+}
+
+int main(int argc, char **argv)
+{
+	std::vector<char *> positional;
+	bool reduce = false;
+	for (int i = 0; i < argc; i++)
+	{
+		if (i > 0 && std::string(argv[i]) == "--reduce")
+			reduce = true;
+		else if (i > 0 && std::string(argv[i]).rfind("--", 0) == 0)
+			return usage(argv[0]);
+		else
+			positional.push_back(argv[i]);
+	}
+	if (positional.size() < 2 || positional.size() > 3)
+		return usage(argv[0]);
+	const std::string path = positional[1];
+	unsigned nb_threads = std::thread::hardware_concurrency();
+	if (positional.size() >= 3)
+		nb_threads = std::max(1, std::atoi(positional[2]));
+
+	sockaddr_un address = {};
+	address.sun_family = AF_UNIX;
+	if (path.size() >= sizeof address.sun_path)
+	{
+		std::cerr << "Socket path too long\n";
+		return 1;
+	}
+	std::strcpy(address.sun_path, path.c_str());
+	std::signal(SIGPIPE, SIG_IGN); // a client leaving early only fails its write
+	listener = ::socket(AF_UNIX, SOCK_STREAM, 0);
+	::unlink(path.c_str());
+	if (listener < 0 || ::bind(listener, (sockaddr *)&address, sizeof address) < 0 || ::listen(listener, 64) < 0)
+	{
+		std::cerr << "Cannot listen on " << path << ": " << std::strerror(errno) << '\n';
+		return 1;
+	}
+
+	TSPService service(nb_threads, reduce);
+	std::cerr << "tspd listening on " << path << " with " << service.threads() << " threads\n";
+	std::list<Connection> connections;
+	while (!stopping.load())
+	{
+		int client = ::accept(listener, nullptr, nullptr);
+		if (client < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		reap(connections, false);
+		connections.emplace_back(client);
+		connections.back().thread = std::thread(serve, std::ref(service), std::ref(connections.back()));
+	}
+	// The clients stop reading: a request being solved is still answered, the idle
+	// clients leave at once. Every one has to leave before the pool stops.
+	for (auto &c : connections)
+		::shutdown(c.socket, SHUT_RD);
+	reap(connections, true);
+	::close(listener);
+	::unlink(path.c_str());
+	return 0;
+}
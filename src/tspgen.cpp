@@ -0,0 +1,98 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+
+#include "tspgenerator.hpp"
+
+// Writes a synthetic instance (see TSPGenerator) in TSPLIB format
+
+static int usage(const char *program)
+{
+	std::cerr << "Usage: " << program << " <uniform|clustered|grid> <nb_cities> [seed] [options]\n"
+			  << "  -o FILE        write FILE instead of the standard output\n"
+			  << "  --cache        also write the binary cache of FILE (see tspcache)\n"
+			  << "  --width=W      side of the square (default 100000)\n"
+			  << "  --clusters=K   clustered: number of centres (default nb_cities / 8, at least 1)\n"
+			  << "  --spread=S     clustered: standard deviation around a centre, in widths (default 0.03)\n"
+			  << "  --noise=F      grid: displacement, in lattice steps (default 0.2)\n";
+	return 1;
+}
+
+int main(int argc, char **argv)
+{
+	std::map<std::string, std::string> options;
+	std::vector<char *> positional;
+	std::string output;
+	for (int i = 0; i < argc; i++)
+	{
+		std::string arg = argv[i];
+		if (i > 0 && arg == "-o" && i + 1 < argc)
+			output = argv[++i];
+		else if (i > 0 && arg.rfind("--", 0) == 0)
+		{
+			size_t eq = arg.find('=');
+			options[arg.substr(2, eq == std::string::npos ? std::string::npos : eq - 2)] =
+				eq == std::string::npos ? "" : arg.substr(eq + 1);
+		}
+		else
+			positional.push_back(argv[i]);
+	}
+	for (auto &option : options)
+		if (option.first != "cache" && option.first != "width" && option.first != "clusters" &&
+			option.first != "spread" && option.first != "noise")
+			return usage(argv[0]);
+	if (positional.size() < 3 || positional.size() > 4)
+		return usage(argv[0]);
+	const std::string kind = positional[1];
+	const int n = std::atoi(positional[2]);
+	const uint64_t seed = positional.size() > 3 ? std::strtoull(positional[3], nullptr, 10) : 1;
+	if (!TSPGenerator::known(kind) || n < 1)
+		return usage(argv[0]);
+	if (options.count("cache") && output.empty())
+	{
+		std::cerr << "--cache needs -o FILE\n";
+		return 1;
+	}
+	TSPGenerator::Options parameters;
+	if (options.count("width"))
+		parameters.width = std::atof(options["width"].c_str());
+	if (options.count("clusters"))
+		parameters.clusters = std::max(1, std::atoi(options["clusters"].c_str()));
+	if (options.count("spread"))
+		parameters.spread = std::atof(options["spread"].c_str());
+	if (options.count("noise"))
+		parameters.noise = std::atof(options["noise"].c_str());
+	TSPGenerator generator(kind, n, seed, parameters);
+
+	// The parameters, without the output ones: the same instance gives the same file
+	std::ostringstream command;
+	command << kind << ' ' << n << ' ' << seed;
+	for (auto &option : options)
+		if (option.first != "cache")
+			command << " --" << option.first << '=' << option.second;
+
+	std::ofstream file;
+	if (!output.empty())
+	{
+		file.open(output);
+		if (!file)
+		{
+			std::cerr << "Cannot write " << output << '\n';
+			return 1;
+		}
+	}
+	generator.write(output.empty() ? std::cout : file, "tspgen " + command.str());
+
+	if (options.count("cache"))
+	{
+		file.close();
+		TSPGraph(output, TSPGraph::Storage::Matrix).writeCache();
+	}
+	return 0;
+}
@@ -0,0 +1,145 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <iomanip>
+#include <memory>
+#include <ostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "tspgraph.hpp"
+
+// Synthetic EUC_2D instances in TSPLIB format, reproducible from their seed:
+//     uniform    cities spread uniformly over the square
+//     clustered  cities around random centres (about normal spread), the rest of the square empty
+//     grid       a square lattice with each city moved by a uniform noise, many ties
+// The random numbers are drawn from std::mt19937_64 only, and the coordinates only go
+// through correctly rounded operations (+ - * / sqrt fmod, no transcendental function
+// of libm), so that a seed gives the same file with every standard library.
+// Shared by tspgen, which writes the files, and tsptest, which solves them.
+class TSPGenerator
+{
+public:
+	struct Options
+	{
+		double width = 100000; // side of the square
+		int clusters = 0;	   // clustered: number of centres, 0 for nb_cities / 8 (at least 1)
+		double spread = 0.03;  // clustered: standard deviation around a centre, in widths
+		double noise = 0.2;	   // grid: displacement, in lattice steps
+	};
+
+	static bool known(const std::string &kind) { return kind == "uniform" || kind == "clustered" || kind == "grid"; }
+
+	TSPGenerator(const std::string &kind, int n, uint64_t seed) : TSPGenerator(kind, n, seed, Options()) {}
+
+	TSPGenerator(const std::string &kind, int n, uint64_t seed, const Options &options)
+		: _rng(seed), _x(n), _y(n)
+	{
+		std::ostringstream name;
+		name << kind << n << '-' << seed;
+		_name = name.str();
+		const double width = options.width;
+		if (kind == "uniform")
+		{
+			for (int i = 0; i < n; i++)
+			{
+				_x[i] = uniform() * width;
+				_y[i] = uniform() * width;
+			}
+		}
+		else if (kind == "clustered")
+		{
+			const int k = std::max(1, options.clusters > 0 ? options.clusters : n / 8);
+			const double spread = options.spread * width;
+			std::vector<double> cx(k), cy(k);
+			for (int c = 0; c < k; c++)
+			{
+				cx[c] = uniform() * width;
+				cy[c] = uniform() * width;
+			}
+			for (int i = 0; i < n; i++)
+			{
+				int c = std::min(k - 1, static_cast<int>(uniform() * k));
+				_x[i] = fold(cx[c] + normal() * spread, width);
+				_y[i] = fold(cy[c] + normal() * spread, width);
+			}
+		}
+		else
+		{
+			const int side = static_cast<int>(std::ceil(std::sqrt(static_cast<double>(n))));
+			const double step = width / side;
+			for (int i = 0; i < n; i++)
+			{
+				_x[i] = ((i % side) + 0.5 + options.noise * (uniform() - 0.5)) * step;
+				_y[i] = ((i / side) + 0.5 + options.noise * (uniform() - 0.5)) * step;
+			}
+		}
+	}
+
+	const std::string &name() const { return _name; }
+
+	// The TSPLIB file, `comment` saying how it was generated
+	void write(std::ostream &out, const std::string &comment) const
+	{
+		out << "NAME: " << _name << '\n'
+			<< "COMMENT: " << comment << '\n'
+			<< "TYPE: TSP\n"
+			<< "DIMENSION: " << _x.size() << '\n'
+			<< "EDGE_WEIGHT_TYPE: EUC_2D\n"
+			<< "NODE_COORD_SECTION\n";
+		for (size_t i = 0; i < _x.size(); i++)
+			out << i + 1 << ' ' << printed(_x[i]) << ' ' << printed(_y[i]) << '\n';
+		out << "EOF\n";
+	}
+
+	// The graph of the written file: the coordinates as printed then parsed
+	std::unique_ptr<TSPGraph> graph() const
+	{
+		std::vector<double> xy;
+		for (size_t i = 0; i < _x.size(); i++)
+			for (double v : {_x[i], _y[i]})
+			{
+				std::istringstream in(printed(v));
+				in >> v;
+				xy.push_back(v);
+			}
+		return std::unique_ptr<TSPGraph>(new TSPGraph(_name, xy));
+	}
+
+private:
+	std::mt19937_64 _rng;
+	std::vector<double> _x, _y;
+	std::string _name;
+
+	// Uniform in [0, 1), from the 53 high bits
+	double uniform() { return (_rng() >> 11) * 0x1.0p-53; }
+
+	// About standard normal: the sum of 12 uniforms (Irwin-Hall) has mean 6 and
+	// variance 1, and is within 6 of its mean
+	double normal()
+	{
+		double sum = 0;
+		for (int i = 0; i < 12; i++)
+			sum += uniform();
+		return sum - 6;
+	}
+
+	// Kept in [0, width]: a coordinate beyond an edge is folded back, as many times as
+	// needed whatever the spread (fmod is exact)
+	static double fold(double v, double width)
+	{
+		v = std::fmod(std::fabs(v), 2 * width);
+		return v > width ? 2 * width - v : v;
+	}
+
+	static std::string printed(double v)
+	{
+		std::ostringstream out;
+		out << std::fixed << std::setprecision(6) << v;
+		return out.str();
+	}
+};
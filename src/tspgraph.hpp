@@ -1,35 +1,272 @@
+#pragma once
+
 #include <iostream>
 #include <fstream>
 #include <sstream>
 #include <string>
 #include <vector>
 #include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
 #include <stdexcept>
 #include <iomanip>
+#include <algorithm>
+#include <numeric>
+#include <thread>
+#include <atomic>
+#include <mutex>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define TSP_X86_KERNELS
+#include <immintrin.h>
+#endif
 
 class TSPGraph
 {
+public:
+	// Binary cache written next to the .tsp file (see tspcache.cpp).
+	// Bump CACHE_VERSION whenever the layout below changes.
+	static const uint32_t CACHE_VERSION = 1;
+
+	// Matrix stores every distance, Lazy computes them from the coordinates on each call
+	// (no matrix, no neighbour lists) and Auto picks Lazy above LAZY_DIMENSION cities.
+	enum class Storage
+	{
+		Auto,
+		Matrix,
+		Lazy
+	};
+	static const int LAZY_DIMENSION = 8192;
+	static const int PARALLEL_DIMENSION = 256; // below, building in one thread is faster
+	static const int TILE = 64;				   // TILE x TILE block of the matrix built at once
+
+	struct CacheHeader
+	{
+		char magic[8];				// "TSPCACHE"
+		uint32_t version;			// CACHE_VERSION
+		uint32_t dimension;			// number of cities
+		uint64_t checksum;			// FNV-1a of the source .tsp file
+		uint64_t coords_offset;		// dimension Points
+		uint64_t dist_offset;		// dimension * dimension int32, row major
+		uint64_t neighbours_offset; // dimension * (dimension - 1) int32, sorted by distance
+		uint64_t file_size;
+		int32_t max_distance;
+		uint32_t reserved;
+	};
+
 private:
 	struct Point
 	{
 		double x, y;
 	};
-	std::vector<Point> _coords;
-	std::vector<std::vector<int>> _dist;
+
+	// Owned storage when parsed from text, empty when the cache is mapped
+	std::vector<Point> _coord_store;
+	std::vector<int> _dist_store;
+	mutable std::vector<int> _neighbour_store; // sorted on the first neighbours() call
+
+	// Views used by the accessors, pointing either to the stores or into the mapping
+	const Point *_coords = nullptr;
+	const int *_dist = nullptr;
+	mutable const int *_neighbours = nullptr;
+	mutable std::once_flag _neighbours_sorted;
+
+	int _dimension = 0;
+	int _size = 0;
+	int _max_distance = 0;
 	int _width;
 	std::string _filename;
 
+	void *_map = nullptr;
+	size_t _map_length = 0;
+
 public:
-	int size() const { return _coords.size(); }
-	int distance(int a, int b) const { return _dist[a][b]; }
-	void resize(int size) { _coords.resize(size); } // permit to choose a lower cities number
+	int size() const { return _size; }
+	int dimension() const { return _dimension; }
+	int distance(int a, int b) const
+	{
+		if (__builtin_expect(_dist != nullptr, 1))
+			return _dist[(size_t)a * _dimension + b];
+		return euc2d(_coords[a], _coords[b]);
+	}
+	// All other cities of the file sorted from the closest to the furthest, dimension() - 1 entries.
+	// After resize() the list still holds the cities >= size(), callers have to skip them.
+	// Not available (nullptr) on a lazy graph. Mapped from the cache, or sorted from the
+	// matrix on the first call (a view sorts its own), so that a search not using
+	// them does not pay for the sort.
+	const int *neighbours(int city) const
+	{
+		if (lazy())
+			return nullptr;
+		std::call_once(_neighbours_sorted, [this]
+					   { if (!_neighbours) sortNeighbours(); });
+		return _neighbours + (size_t)city * (_dimension - 1);
+	}
+	double x(int city) const { return _coords[city].x; }
+	double y(int city) const { return _coords[city].y; }
+	bool cached() const { return _map != nullptr; }
+	bool lazy() const { return _dist == nullptr; }
+	const std::string &filename() const { return _filename; }
+
+	void resize(int size) // permit to choose a lower cities number
+	{
+		if (size > _dimension)
+			throw std::runtime_error("Graph size bigger than DIMENSION");
+		_size = size;
+	}
+
+	TSPGraph(const std::string &filename, Storage storage = Storage::Auto) : _filename(filename)
+	{
+		std::string text = readFile(filename);
+		uint64_t sum = checksum(text);
+		const std::string cache = cachePath(filename);
+
+		if (storage == Storage::Lazy || !mapCache(cache, sum))
+		{
+			std::istringstream in(text);
+			parse(in);
+			build(storage);
+			// A cache that exists but does not match the source is stale: rebuild it
+			if (!lazy() && access(cache.c_str(), F_OK) == 0)
+			{
+				std::cerr << "Rebuilding stale cache " << cache << '\n';
+				try
+				{
+					writeCache(cache, sum);
+				}
+				catch (const std::exception &e)
+				{
+					std::cerr << e.what() << '\n'; // the parsed graph is still usable
+				}
+			}
+		}
+		_size = _dimension;
+		setWidth();
+	}
+
+	// The first `size` cities of another graph, sharing its storage: the source has to
+	// outlive the view
+	TSPGraph(const TSPGraph &source, int size)
+		: _coords(source._coords), _dist(source._dist), _neighbours(source._neighbours),
+		  _dimension(source._dimension), _max_distance(source._max_distance), _width(source._width),
+		  _filename(source._filename)
+	{
+		resize(size);
+	}
+
+	// A graph given by its coordinates x0, y0, x1, y1... instead of a file, never cached
+	TSPGraph(const std::string &name, const std::vector<double> &xy, Storage storage = Storage::Auto) : _filename(name)
+	{
+		if (xy.empty() || xy.size() % 2)
+			throw std::runtime_error("Invalid coordinates");
+		_dimension = (int)(xy.size() / 2);
+		_coord_store.resize(_dimension);
+		for (int i = 0; i < _dimension; i++)
+			_coord_store[i] = {xy[2 * i], xy[2 * i + 1]};
+		_coords = _coord_store.data();
+		build(storage);
+		_size = _dimension;
+		setWidth();
+	}
+
+	~TSPGraph()
+	{
+		if (_map)
+			munmap(_map, _map_length);
+	}
+
+	// The views may point into a mapping owned by this object
+	TSPGraph(const TSPGraph &) = delete;
+	TSPGraph &operator=(const TSPGraph &) = delete;
 
-	TSPGraph(const std::string &filename)
+	static std::string cachePath(const std::string &filename) { return filename + ".cache"; }
+
+	// Write the binary cache of this graph for the given source file
+	void writeCache() const { writeCache(cachePath(_filename), checksum(readFile(_filename))); }
+
+	// Compare every stored distance with the scalar euc2d, returns the number of mismatches
+	long verify() const
+	{
+		long errors = 0;
+		if (lazy())
+			return errors;
+		for (int i = 0; i < _dimension; i++)
+			for (int j = 0; j < _dimension; j++)
+				if (distance(i, j) != euc2d(_coords[i], _coords[j]))
+					errors++;
+		return errors;
+	}
+
+	void write(std::ostream &os) const
+	{
+		std::cout << "TSP graph from file " << _filename << '\n';
+		int n = size();
+		for (int i = 0; i < n; i++)
+			os << " point " << i << " { x: " << _coords[i].x << ", y: " << _coords[i].y << "}\n";
+		os << "  ";
+		for (int j = n - 1; j > 0; --j)
+			os << std::setw(_width) << j;
+		os << '\n';
+		for (int i = 0; i < (n - 1); i++)
+		{
+			os << std::setw(3) << i;
+			for (int j = (n - 1); j > i; j--)
+				os << std::setw(_width) << distance(i, j);
+			os << '\n';
+		}
+	}
+
+private:
+	static int euc2d(const Point &a, const Point &b)
+	{
+		double dx = a.x - b.x;
+		double dy = a.y - b.y;
+		return static_cast<int>(std::round(std::sqrt(dx * dx + dy * dy)));
+	}
+
+	static std::string readFile(const std::string &filename)
 	{
-		std::ifstream in(filename);
+		std::ifstream in(filename, std::ios::binary);
 		if (!in)
 			throw std::runtime_error("Cannot open file: " + filename);
-		_filename = filename;
+		std::ostringstream ss;
+		ss << in.rdbuf();
+		return ss.str();
+	}
+
+	static uint64_t checksum(const std::string &data)
+	{
+		uint64_t h = 14695981039346656037ull; // FNV-1a
+		for (unsigned char c : data)
+		{
+			h ^= c;
+			h *= 1099511628211ull;
+		}
+		return h;
+	}
+
+	static uint64_t align(uint64_t offset) { return (offset + 63) & ~uint64_t(63); }
+
+	void setWidth()
+	{
+		int max = _max_distance;
+		int digits = 1;
+		while (max >= 10)
+		{
+			max /= 10;
+			digits++;
+		}
+		_width = digits + 1; // used only for printing
+	}
+
+	void parse(std::istream &in)
+	{
 		std::string line;
 		int dimension = -1;
 		bool inCoordSection = false;
@@ -54,7 +291,7 @@ public:
 			throw std::runtime_error("Invalid or missing DIMENSION");
 		if (!inCoordSection)
 			throw std::runtime_error("Missing NODE_COORD_SECTION");
-		_coords.assign(dimension, {0, 0});
+		_coord_store.assign(dimension, {0, 0});
 		int count = 0;
 		while (std::getline(in, line))
 		{
@@ -69,57 +306,270 @@ public:
 				continue;
 			if (index < 1 || index > dimension)
 				throw std::runtime_error("Invalid city index");
-			_coords[index - 1] = {x, y};
+			_coord_store[index - 1] = {x, y};
 			count++;
 		}
 		if (count != dimension)
 			throw std::runtime_error("Coordinate count mismatch");
-		_dist.assign(dimension, std::vector<int>(dimension, 0));
+		_dimension = dimension;
+		_coords = _coord_store.data();
+	}
+
+	// Run f(id) on `count` threads (only the calling thread when count is 1)
+	template <typename F>
+	static void parallel(int count, F f)
+	{
+		std::vector<std::thread> threads;
+		for (int id = 1; id < count; id++)
+			threads.emplace_back(f, id);
+		f(0);
+		for (auto &th : threads)
+			th.join();
+	}
+
+	// out[j] = euc2d((x, y), (xs[j], ys[j])) for j < count, returns the maximum.
+	// The binaries stay portable: the AVX-512 or AVX2 kernel is only compiled for its
+	// own target and picked once from the CPU running the program. The vector kernels
+	// round like std::round (half away from zero) on the same correctly rounded sqrt,
+	// so the results are bit-identical to euc2d.
+	static int distanceRow(double x, double y, const double *xs, const double *ys, int count, int *out)
+	{
+		using Kernel = int (*)(double, double, const double *, const double *, int, int *);
+		static const Kernel kernel = []() -> Kernel
+		{
+#if defined(TSP_X86_KERNELS)
+			__builtin_cpu_init();
+			if (__builtin_cpu_supports("avx512f"))
+				return distanceRowAvx512;
+			if (__builtin_cpu_supports("avx2"))
+				return distanceRowAvx2;
+#endif
+			return distanceRowScalar;
+		}();
+		return kernel(x, y, xs, ys, count, out);
+	}
+
+	static int distanceRowScalar(double x, double y, const double *xs, const double *ys, int count, int *out)
+	{
+		return distanceTail(x, y, xs, ys, count, out, 0, 0);
+	}
+
+	// The cities from j on, one at a time, max being the maximum of the ones before
+	static int distanceTail(double x, double y, const double *xs, const double *ys, int count, int *out, int j, int max)
+	{
+		for (; j < count; j++)
+		{
+			out[j] = euc2d({x, y}, {xs[j], ys[j]});
+			max = std::max(max, out[j]);
+		}
+		return max;
+	}
+
+#if defined(TSP_X86_KERNELS)
+	__attribute__((target("avx512f,avx2"))) static int distanceRowAvx512(double x, double y, const double *xs, const double *ys, int count, int *out)
+	{
+		int j = 0;
 		int max = 0;
-		for (int i = 0; i < dimension; ++i)
+		const __m512d vx = _mm512_set1_pd(x), vy = _mm512_set1_pd(y);
+		const __m512d half = _mm512_set1_pd(0.5), one = _mm512_set1_pd(1.0);
+		__m256i vmax = _mm256_setzero_si256();
+		for (; j + 8 <= count; j += 8)
 		{
-			for (int j = i + 1; j < dimension; ++j)
-			{
-				int d = _dist[j][i] = euc2d(_coords[i], _coords[j]);
-				_dist[i][j] = d;
-				if (d > max)
-					max = d;
-			}
+			__m512d dx = _mm512_sub_pd(vx, _mm512_loadu_pd(xs + j));
+			__m512d dy = _mm512_sub_pd(vy, _mm512_loadu_pd(ys + j));
+			__m512d r = _mm512_sqrt_pd(_mm512_add_pd(_mm512_mul_pd(dx, dx), _mm512_mul_pd(dy, dy)));
+			__m512d t = _mm512_roundscale_pd(r, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC);
+			__mmask8 up = _mm512_cmp_pd_mask(_mm512_sub_pd(r, t), half, _CMP_GE_OQ);
+			__m256i d = _mm512_cvttpd_epi32(_mm512_mask_add_pd(t, up, t, one));
+			_mm256_storeu_si256(reinterpret_cast<__m256i *>(out + j), d);
+			vmax = _mm256_max_epi32(vmax, d);
 		}
-		int digits = 1;
-		while (max >= 10)
+		alignas(32) int lanes[8];
+		_mm256_store_si256(reinterpret_cast<__m256i *>(lanes), vmax);
+		for (int l = 0; l < 8; l++)
+			max = std::max(max, lanes[l]);
+		return distanceTail(x, y, xs, ys, count, out, j, max);
+	}
+
+	__attribute__((target("avx2"))) static int distanceRowAvx2(double x, double y, const double *xs, const double *ys, int count, int *out)
+	{
+		int j = 0;
+		int max = 0;
+		const __m256d vx = _mm256_set1_pd(x), vy = _mm256_set1_pd(y);
+		const __m256d half = _mm256_set1_pd(0.5), one = _mm256_set1_pd(1.0);
+		__m128i vmax = _mm_setzero_si128();
+		for (; j + 4 <= count; j += 4)
 		{
-			max /= 10;
-			digits++;
+			__m256d dx = _mm256_sub_pd(vx, _mm256_loadu_pd(xs + j));
+			__m256d dy = _mm256_sub_pd(vy, _mm256_loadu_pd(ys + j));
+			__m256d r = _mm256_sqrt_pd(_mm256_add_pd(_mm256_mul_pd(dx, dx), _mm256_mul_pd(dy, dy)));
+			__m256d t = _mm256_round_pd(r, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC);
+			__m256d up = _mm256_and_pd(_mm256_cmp_pd(_mm256_sub_pd(r, t), half, _CMP_GE_OQ), one);
+			__m128i d = _mm256_cvttpd_epi32(_mm256_add_pd(t, up));
+			_mm_storeu_si128(reinterpret_cast<__m128i *>(out + j), d);
+			vmax = _mm_max_epi32(vmax, d);
 		}
-		_width = digits + 1; // used only for printing
+		alignas(16) int lanes[4];
+		_mm_store_si128(reinterpret_cast<__m128i *>(lanes), vmax);
+		for (int l = 0; l < 4; l++)
+			max = std::max(max, lanes[l]);
+		return distanceTail(x, y, xs, ys, count, out, j, max);
 	}
+#endif
 
-	void write(std::ostream &os) const
+	// Fill the distance matrix from the coordinates.
+	// The matrix is built by TILE x TILE blocks of the upper triangle, each block being
+	// mirrored while it is still in cache, and the blocks are shared between threads.
+	void build(Storage storage)
 	{
-		std::cout << "TSP graph from file " << _filename << '\n';
-		int n = size();
+		const int n = _dimension;
+		if (storage == Storage::Lazy || (storage == Storage::Auto && n > LAZY_DIMENSION))
+			return;
+
+		std::vector<double> xs(n), ys(n);
 		for (int i = 0; i < n; i++)
-			os << " point " << i << " { x: " << _coords[i].x << ", y: " << _coords[i].y << "}\n";
-		os << "  ";
-		for (int j = n - 1; j > 0; --j)
-			os << std::setw(_width) << j;
-		os << '\n';
-		for (int i = 0; i < (n - 1); i++)
 		{
-			os << std::setw(3) << i;
-			for (int j = (n - 1); j > i; j--)
-				os << std::setw(_width) << _dist[i][j];
-			os << '\n';
+			xs[i] = _coords[i].x;
+			ys[i] = _coords[i].y;
 		}
+		_dist_store.resize((size_t)n * n);
+		int *dist = _dist_store.data();
+
+		const int tiles = (n + TILE - 1) / TILE;
+		int nthreads = 1;
+		if (n >= PARALLEL_DIMENSION)
+			nthreads = std::max(1, std::min((int)std::thread::hardware_concurrency(), tiles * (tiles + 1) / 2));
+		std::vector<int> maxima(nthreads, 0);
+		std::atomic<int> next{0};
+
+		parallel(nthreads, [&](int id)
+				 {
+			int max = 0;
+			for (int p; (p = next.fetch_add(1, std::memory_order_relaxed)) < tiles * tiles;)
+			{
+				const int ti = p / tiles, tj = p % tiles;
+				if (ti > tj)
+					continue; // lower triangle, mirrored from (tj, ti)
+				const int i0 = ti * TILE, i1 = std::min(n, i0 + TILE);
+				const int j0 = tj * TILE, j1 = std::min(n, j0 + TILE);
+				for (int i = i0; i < i1; i++)
+				{
+					int *row = dist + (size_t)i * n + j0;
+					max = std::max(max, distanceRow(xs[i], ys[i], xs.data() + j0, ys.data() + j0, j1 - j0, row));
+					if (ti != tj)
+						for (int j = j0; j < j1; j++)
+							dist[(size_t)j * n + i] = row[j - j0];
+				}
+			}
+			maxima[id] = max; });
+
+		_dist = dist;
+		_max_distance = *std::max_element(maxima.begin(), maxima.end());
 	}
 
-private:
-	static int euc2d(const Point &a, const Point &b)
+	// The other cities of each city sorted by distance, then by index
+	void sortNeighbours() const
 	{
-		double dx = a.x - b.x;
-		double dy = a.y - b.y;
-		return static_cast<int>(std::round(std::sqrt(dx * dx + dy * dy)));
+		const int n = _dimension;
+		int nthreads = 1;
+		if (n >= PARALLEL_DIMENSION)
+			nthreads = std::max(1, std::min((int)std::thread::hardware_concurrency(), n));
+		std::atomic<int> next{0};
+		_neighbour_store.resize((size_t)n * (n - 1));
+		parallel(nthreads, [&](int)
+				 {
+			for (int i; (i = next.fetch_add(1, std::memory_order_relaxed)) < n;)
+			{
+				int *row = _neighbour_store.data() + (size_t)i * (n - 1);
+				const int *d = _dist + (size_t)i * n;
+				int k = 0;
+				for (int j = 0; j < n; ++j)
+					if (j != i)
+						row[k++] = j;
+				std::sort(row, row + k, [d](int a, int b)
+						  { return d[a] < d[b] || (d[a] == d[b] && a < b); });
+			} });
+		_neighbours = _neighbour_store.data();
+	}
+
+	// Map a cache file and point the views into it. Returns false when the cache
+	// is missing, corrupted, from another version or built from another source.
+	bool mapCache(const std::string &path, uint64_t sum)
+	{
+		int fd = open(path.c_str(), O_RDONLY);
+		if (fd < 0)
+			return false;
+		struct stat st;
+		if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(CacheHeader))
+		{
+			close(fd);
+			return false;
+		}
+		size_t length = (size_t)st.st_size;
+		void *map = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (map == MAP_FAILED)
+			return false;
+
+		const CacheHeader *h = static_cast<const CacheHeader *>(map);
+		const uint64_t n = h->dimension;
+		bool valid = std::memcmp(h->magic, "TSPCACHE", 8) == 0 &&
+					 h->version == CACHE_VERSION &&
+					 h->checksum == sum &&
+					 h->file_size == length &&
+					 n > 0 &&
+					 h->coords_offset + n * sizeof(Point) <= length &&
+					 h->dist_offset + n * n * sizeof(int32_t) <= length &&
+					 h->neighbours_offset + n * (n - 1) * sizeof(int32_t) <= length;
+		if (!valid)
+		{
+			munmap(map, length);
+			return false;
+		}
+
+		const char *base = static_cast<const char *>(map);
+		_map = map;
+		_map_length = length;
+		_dimension = (int)n;
+		_max_distance = h->max_distance;
+		_coords = reinterpret_cast<const Point *>(base + h->coords_offset);
+		_dist = reinterpret_cast<const int *>(base + h->dist_offset);
+		_neighbours = reinterpret_cast<const int *>(base + h->neighbours_offset);
+		return true;
+	}
+
+	void writeCache(const std::string &path, uint64_t sum) const
+	{
+		if (lazy())
+			throw std::runtime_error("A lazy graph has no matrix to cache: " + path);
+		const uint64_t n = _dimension;
+		CacheHeader h;
+		std::memset(&h, 0, sizeof(h));
+		std::memcpy(h.magic, "TSPCACHE", 8);
+		h.version = CACHE_VERSION;
+		h.dimension = (uint32_t)n;
+		h.checksum = sum;
+		h.max_distance = _max_distance;
+		h.coords_offset = align(sizeof(CacheHeader));
+		h.dist_offset = align(h.coords_offset + n * sizeof(Point));
+		h.neighbours_offset = align(h.dist_offset + n * n * sizeof(int32_t));
+		h.file_size = h.neighbours_offset + n * (n - 1) * sizeof(int32_t);
+
+		std::vector<char> buffer(h.file_size, 0);
+		std::memcpy(buffer.data(), &h, sizeof(h));
+		std::memcpy(buffer.data() + h.coords_offset, _coords, n * sizeof(Point));
+		std::memcpy(buffer.data() + h.dist_offset, _dist, n * n * sizeof(int32_t));
+		std::memcpy(buffer.data() + h.neighbours_offset, neighbours(0), n * (n - 1) * sizeof(int32_t));
+
+		// Write aside then rename, so that concurrent runs never map a half written file
+		const std::string tmp = path + ".tmp" + std::to_string(getpid());
+		std::ofstream out(tmp, std::ios::binary);
+		if (!out.write(buffer.data(), (std::streamsize)buffer.size()) || (out.close(), !out) ||
+			std::rename(tmp.c_str(), path.c_str()) != 0)
+		{
+			std::remove(tmp.c_str());
+			throw std::runtime_error("Cannot write cache file: " + path);
+		}
 	}
 };
 
@@ -0,0 +1,522 @@
+#pragma once
+
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <deque>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "tspgraph.hpp"
+#include "task.hpp"
+
+// Uniform grid over the cities, about two per cell, answering nearest-city queries
+// among the cities not removed yet
+class TSPGrid
+{
+private:
+	const TSPGraph &_graph;
+	std::vector<std::vector<int>> _cells;
+	std::vector<int> _slot; // index of each city in its cell
+	int _side;
+	double _x0, _y0, _cell;
+
+	int cellX(int city) const { return std::min(_side - 1, (int)((_graph.x(city) - _x0) / _cell)); }
+	int cellY(int city) const { return std::min(_side - 1, (int)((_graph.y(city) - _y0) / _cell)); }
+
+public:
+	explicit TSPGrid(const TSPGraph &graph) : _graph(graph), _slot(graph.size())
+	{
+		const int n = graph.size();
+		double x1 = graph.x(0), y1 = graph.y(0);
+		_x0 = x1;
+		_y0 = y1;
+		for (int i = 1; i < n; ++i)
+		{
+			_x0 = std::min(_x0, graph.x(i));
+			_y0 = std::min(_y0, graph.y(i));
+			x1 = std::max(x1, graph.x(i));
+			y1 = std::max(y1, graph.y(i));
+		}
+		_side = std::max(1, (int)std::sqrt(n / 2.0));
+		_cell = std::max(x1 - _x0, y1 - _y0) / _side;
+		if (_cell <= 0)
+			_cell = 1;
+		_cells.resize((size_t)_side * _side);
+		for (int i = 0; i < n; ++i)
+		{
+			auto &cell = _cells[(size_t)cellY(i) * _side + cellX(i)];
+			_slot[i] = (int)cell.size();
+			cell.push_back(i);
+		}
+	}
+
+	void remove(int city)
+	{
+		auto &cell = _cells[(size_t)cellY(city) * _side + cellX(city)];
+		const int last = cell.back();
+		cell[_slot[city]] = last;
+		_slot[last] = _slot[city];
+		cell.pop_back();
+	}
+
+	// The k cities closest to `city` still in the grid (city excluded), from the closest.
+	// Rings of cells are visited around the cell of the city until the ring cannot hold
+	// anything closer than the k-th city found.
+	void nearest(int city, int k, std::vector<int> &out) const
+	{
+		const double x = _graph.x(city), y = _graph.y(city);
+		const int cx = cellX(city), cy = cellY(city);
+		std::vector<std::pair<double, int>> heap; // max-heap of the best k (squared distance, city)
+		auto visit = [&](int gx, int gy)
+		{
+			if (gx < 0 || gy < 0 || gx >= _side || gy >= _side)
+				return;
+			for (int c : _cells[(size_t)gy * _side + gx])
+			{
+				if (c == city)
+					continue;
+				const double dx = _graph.x(c) - x, dy = _graph.y(c) - y;
+				const double d2 = dx * dx + dy * dy;
+				if ((int)heap.size() < k)
+				{
+					heap.emplace_back(d2, c);
+					std::push_heap(heap.begin(), heap.end());
+				}
+				else if (d2 < heap.front().first)
+				{
+					std::pop_heap(heap.begin(), heap.end());
+					heap.back() = {d2, c};
+					std::push_heap(heap.begin(), heap.end());
+				}
+			}
+		};
+		for (int r = 0; r <= _side; ++r)
+		{
+			if (r == 0)
+				visit(cx, cy);
+			for (int g = -r; g <= r && r > 0; ++g)
+			{
+				visit(cx + g, cy - r);
+				visit(cx + g, cy + r);
+				if (g != -r && g != r)
+				{
+					visit(cx - r, cy + g);
+					visit(cx + r, cy + g);
+				}
+			}
+			// Cities beyond ring r are at least r cells away
+			if ((int)heap.size() == k && heap.front().first <= (r * _cell) * (r * _cell))
+				break;
+		}
+		std::sort_heap(heap.begin(), heap.end());
+		out.clear();
+		for (auto &e : heap)
+			out.push_back(e.second);
+	}
+};
+
+// A tour as an array of cities and the position of each city, reversals flip the
+// shorter side so that the orientation of the array may change after a move. The
+// moves since the last commit() are journaled, rollback() undoes them in place.
+class TSPTour
+{
+private:
+	std::vector<int> _city, _pos;
+
+	// A flip of len cities from position i forward and j backward, or a swap of the
+	// segments of j then len cities after position i
+	struct Move
+	{
+		int i, j, len;
+		bool swap;
+	};
+	std::vector<Move> _journal;
+
+	void flip(int i, int j, int len)
+	{
+		const int n = size();
+		for (; len > 1; len -= 2)
+		{
+			std::swap(_city[i], _city[j]);
+			_pos[_city[i]] = i;
+			_pos[_city[j]] = j;
+			i = i + 1 == n ? 0 : i + 1;
+			j = j == 0 ? n - 1 : j - 1;
+		}
+	}
+
+	void rotate(int i, int la, int lb)
+	{
+		const int n = size();
+		std::vector<int> window(la + lb);
+		for (int k = 0; k < la + lb; ++k)
+			window[k] = _city[(i + 1 + k) % n];
+		std::rotate(window.begin(), window.begin() + la, window.end());
+		for (int k = 0; k < la + lb; ++k)
+		{
+			const int p = (i + 1 + k) % n;
+			_city[p] = window[k];
+			_pos[window[k]] = p;
+		}
+	}
+
+public:
+	explicit TSPTour(const std::vector<int> &order) : _city(order), _pos(order.size())
+	{
+		for (int i = 0; i < (int)order.size(); ++i)
+			_pos[order[i]] = i;
+	}
+
+	int size() const { return (int)_city.size(); }
+	int city(int i) const { return _city[i]; }
+	int succ(int c) const
+	{
+		const int i = _pos[c] + 1;
+		return _city[i == size() ? 0 : i];
+	}
+	int pred(int c) const
+	{
+		const int i = _pos[c];
+		return _city[i == 0 ? size() - 1 : i - 1];
+	}
+	// Whether b is on the path from a forward to c
+	bool between(int a, int b, int c) const
+	{
+		const int pa = _pos[a], pb = _pos[b], pc = _pos[c];
+		return pa <= pc ? pa <= pb && pb <= pc : pb >= pa || pb <= pc;
+	}
+
+	// Reverse the path from a forward to b, or the rest of the tour when it is shorter
+	void reverse(int a, int b)
+	{
+		const int n = size();
+		int i = _pos[a], j = _pos[b];
+		int len = (j - i + n) % n + 1;
+		if (2 * len > n)
+		{
+			const int k = i;
+			i = j + 1 == n ? 0 : j + 1;
+			j = k == 0 ? n - 1 : k - 1;
+			len = n - len;
+		}
+		_journal.push_back({i, j, len, false});
+		flip(i, j, len);
+	}
+
+	// Replace the edges (t1, t2) and (t3, t4) by (t1, t3) and (t2, t4), t2 and t4
+	// following t1 and t3 in the same direction
+	void move2opt(int t1, int t2, int t3, int t4)
+	{
+		if (succ(t1) == t2)
+			reverse(t2, t3);
+		else
+			reverse(t1, t4);
+	}
+
+	// Swap the segments of la and lb cities following position i (a double bridge
+	// kept local), returns the ends of the changed edges in `touched`
+	void swapSegments(int i, int la, int lb, std::vector<int> &touched)
+	{
+		const int n = size();
+		touched = {_city[i], _city[(i + 1) % n], _city[(i + la) % n], _city[(i + la + 1) % n],
+				   _city[(i + la + lb) % n], _city[(i + la + lb + 1) % n]};
+		_journal.push_back({i, la, lb, true});
+		rotate(i, la, lb);
+	}
+
+	// Keep the moves done so far
+	void commit() { _journal.clear(); }
+
+	// Undo the moves since the last commit(), last first
+	void rollback()
+	{
+		for (auto m = _journal.rbegin(); m != _journal.rend(); ++m)
+			if (m->swap)
+				rotate(m->i, m->len, m->j);
+			else
+				flip(m->i, m->j, m->len);
+		_journal.clear();
+	}
+
+	long length(const TSPGraph &graph) const
+	{
+		long total = 0;
+		for (int i = 0; i < size(); ++i)
+			total += graph.distance(_city[i], _city[i + 1 == size() ? 0 : i + 1]);
+		return total;
+	}
+};
+
+// 2-opt and Or-opt moves restricted to the candidate neighbours, driven by a queue of
+// the cities whose don't-look bit is off
+class TSPLocalSearch
+{
+private:
+	const TSPGraph &_graph;
+	const std::vector<int> &_candidates; // k per city, from the closest
+	const int _k;
+	std::vector<char> _queued;
+	std::deque<int> _queue;
+
+	int d(int a, int b) const { return _graph.distance(a, b); }
+
+public:
+	long two_opt_moves = 0;
+	long or_opt_moves = 0;
+
+	TSPLocalSearch(const TSPGraph &graph, const std::vector<int> &candidates, int k)
+		: _graph(graph), _candidates(candidates), _k(k), _queued(graph.size(), 0) {}
+
+	void activate(int city)
+	{
+		if (!_queued[city])
+		{
+			_queued[city] = 1;
+			_queue.push_back(city);
+		}
+	}
+
+	// Apply improving moves until every don't-look bit is set, returns the gain
+	long optimise(TSPTour &tour)
+	{
+		long total = 0;
+		while (!_queue.empty())
+		{
+			const int a = _queue.front();
+			_queue.pop_front();
+			_queued[a] = 0;
+			int gain = twoOpt(tour, a);
+			if (gain <= 0)
+				gain = orOpt(tour, a);
+			total += std::max(gain, 0);
+		}
+		return total;
+	}
+
+private:
+	// Replace the edge from a to its successor (or predecessor) by an edge to a candidate
+	int twoOpt(TSPTour &t, int a)
+	{
+		for (int dir = 0; dir < 2; ++dir)
+		{
+			const int b = dir ? t.pred(a) : t.succ(a);
+			const int ab = d(a, b);
+			for (int k = 0; k < _k; ++k)
+			{
+				const int c = _candidates[(size_t)a * _k + k];
+				const int g1 = ab - d(a, c);
+				if (g1 <= 0)
+					break; // the candidates are sorted
+				const int e = dir ? t.pred(c) : t.succ(c);
+				if (c == b || e == a)
+					continue;
+				const int gain = g1 + d(c, e) - d(b, e);
+				if (gain > 0)
+				{
+					t.move2opt(a, b, c, e);
+					for (int x : {a, b, c, e})
+						activate(x);
+					++two_opt_moves;
+					return gain;
+				}
+			}
+		}
+		return 0;
+	}
+
+	// Move the segment of 1 to 3 cities starting at a between two neighbours of its
+	// ends, in either orientation. Done as three 2-opt moves.
+	int orOpt(TSPTour &t, int a)
+	{
+		const int s1 = a;
+		int s2 = a;
+		for (int len = 1; len <= 3 && len + 3 <= t.size(); ++len, s2 = t.succ(s2))
+		{
+			const int p = t.pred(s1), q = t.succ(s2);
+			const int g1 = d(p, s1) + d(s2, q) - d(p, q);
+			if (g1 <= 0)
+				continue;
+			for (int end : {s1, s2})
+				for (int k = 0; k < _k; ++k)
+				{
+					const int c = _candidates[(size_t)end * _k + k];
+					if (d(end, c) >= g1)
+						break;
+					if (t.between(s1, c, s2))
+						continue;
+					for (int side = 0; side < 2; ++side)
+					{
+						const int x = side ? t.pred(c) : c, y = side ? c : t.succ(c);
+						if (t.between(s1, x, s2) || t.between(s1, y, s2) || y == p || x == q)
+							continue;
+						const int forward = d(x, s1) + d(s2, y), reversed = d(x, s2) + d(s1, y);
+						const int gain = g1 + d(x, y) - std::min(forward, reversed);
+						if (gain <= 0)
+							continue;
+						t.move2opt(p, s1, x, y); // p x .. q s2 .. s1 y
+						t.move2opt(p, x, q, s2); // p q .. x s2 .. s1 y
+						if (forward < reversed)
+							t.move2opt(x, s2, s1, y); // x s1 .. s2 y
+						for (int z : {p, q, s1, s2, x, y})
+							activate(z);
+						++or_opt_moves;
+						return gain;
+					}
+				}
+		}
+		return 0;
+	}
+};
+
+// Heuristic solver for instances too big for the branch and bound: each thread builds
+// a nearest-neighbour tour from its own start, improves it with 2-opt and Or-opt, then
+// kicks it with local double bridges, keeping a kick when the local search that follows
+// ends on a shorter tour. The best tour of the threads wins.
+class TSPHeuristicSolver : public RunTimer
+{
+public:
+	static const int DEFAULT_CANDIDATES = 8;
+	static const int MAX_KICK_SEGMENT = 50;
+
+	struct Stats
+	{
+		long start_length = 0; // best nearest-neighbour tour
+		long kicks = 0;
+		long accepted = 0;
+		long two_opt_moves = 0;
+		long or_opt_moves = 0;
+	};
+
+private:
+	const TSPGraph &_graph;
+	unsigned _threads;
+	long _kicks; // per thread
+	int _k;
+	unsigned _seed;
+	std::vector<int> _candidates;
+	std::vector<int> _best;
+	long _best_length = LONG_MAX;
+	Stats _stats;
+	std::mutex _mutex;
+
+public:
+	TSPHeuristicSolver(const TSPGraph &graph, unsigned threads, long kicks, int candidates = DEFAULT_CANDIDATES, unsigned seed = 1)
+		: _graph(graph), _threads(std::max(1u, threads)), _kicks(kicks),
+		  _k(std::max(1, std::min(candidates, graph.size() - 1))), _seed(seed) {}
+
+	void run()
+	{
+		startTimer();
+		const int n = _graph.size();
+		if (n < 8) // too small for the moves, keep the file order
+		{
+			for (int i = 0; i < n; ++i)
+				_best.push_back(i);
+			_best_length = TSPTour(_best).length(_graph);
+			stopTimer();
+			return;
+		}
+		TSPGrid grid(_graph);
+		_candidates.resize((size_t)n * _k);
+		std::vector<int> near;
+		for (int i = 0; i < n; ++i)
+		{
+			grid.nearest(i, _k, near);
+			std::copy(near.begin(), near.end(), _candidates.begin() + (size_t)i * _k);
+		}
+
+		std::vector<std::thread> workers;
+		for (unsigned t = 0; t < _threads; ++t)
+			workers.emplace_back([this, t, &grid]
+								 { improve(grid, _seed + t); });
+		for (auto &w : workers)
+			w.join();
+		stopTimer();
+	}
+
+	long length() const { return _best_length; }
+	const std::vector<int> &tour() const { return _best; } // every city once, not closed
+	const Stats &stats() const { return _stats; }
+	int candidates() const { return _k; }
+
+	// Same format as TSPPath: [length: 0, ..., 0]
+	void write(std::ostream &os) const
+	{
+		const int n = (int)_best.size();
+		const int start = (int)(std::find(_best.begin(), _best.end(), 0) - _best.begin());
+		os << "[" << _best_length << ": ";
+		for (int i = 0; i <= n; i++)
+		{
+			if (i)
+				os << ", ";
+			os << _best[(start + i) % n];
+		}
+		os << "]";
+	}
+
+private:
+	void improve(TSPGrid grid, unsigned seed)
+	{
+		const int n = _graph.size();
+		std::mt19937 rng(seed);
+		std::vector<int> order;
+		order.reserve(n);
+		order.push_back(std::uniform_int_distribution<int>(0, n - 1)(rng));
+		grid.remove(order[0]);
+		std::vector<int> near;
+		while ((int)order.size() < n)
+		{
+			grid.nearest(order.back(), 1, near);
+			order.push_back(near[0]);
+			grid.remove(near[0]);
+		}
+
+		TSPTour current(order);
+		const long start_length = current.length(_graph);
+		TSPLocalSearch search(_graph, _candidates, _k);
+		for (int c : order)
+			search.activate(c);
+		long length = start_length - search.optimise(current);
+
+		current.commit();
+		std::vector<int> touched;
+		const int max_segment = std::min((int)MAX_KICK_SEGMENT, (n - 2) / 2);
+		std::uniform_int_distribution<int> position(0, n - 1), segment(1, max_segment);
+		long accepted = 0;
+		for (long kick = 0; kick < _kicks; ++kick)
+		{
+			current.swapSegments(position(rng), segment(rng), segment(rng), touched);
+			const int i = touched[0], a1 = touched[1], a2 = touched[2], b1 = touched[3], b2 = touched[4], j = touched[5];
+			// Edges (i a1) (a2 b1) (b2 j) became (i b1) (b2 a1) (a2 j)
+			const long delta = (long)_graph.distance(i, b1) + _graph.distance(b2, a1) + _graph.distance(a2, j) - _graph.distance(i, a1) - _graph.distance(a2, b1) - _graph.distance(b2, j);
+			for (int c : touched)
+				search.activate(c);
+			const long trial_length = length + delta - search.optimise(current);
+			if (trial_length < length)
+			{
+				current.commit();
+				length = trial_length;
+				++accepted;
+			}
+			else
+				current.rollback(); // in place, the kick and the moves that followed
+		}
+
+		std::lock_guard<std::mutex> lock(_mutex);
+		_stats.start_length = _stats.start_length ? std::min(_stats.start_length, start_length) : start_length;
+		_stats.kicks += _kicks;
+		_stats.accepted += accepted;
+		_stats.two_opt_moves += search.two_opt_moves;
+		_stats.or_opt_moves += search.or_opt_moves;
+		if (length < _best_length)
+		{
+			_best_length = current.length(_graph); // recomputed, the gains were summed
+			_best.resize(n);
+			for (int p = 0; p < n; ++p)
+				_best[p] = current.city(p);
+		}
+	}
+};
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <type_traits>
+
+#include "tsptask.hpp"
+#include "workstealing.hpp"
+
+// TSP on the work-stealing engine without heap tasks: the deques hold TSPPrefix
+// values, split and solve are direct calls. Only the solve of a prefix builds a
+// TSPTask, on the stack of the worker.
+class TSPPrefixOps
+{
+private:
+	TSPContext *_context;
+	int _cutoff_size;
+	TSPOrdering *_ordering;
+
+public:
+	explicit TSPPrefixOps(TSPContext *context = nullptr, int cutoff_size = TSPPath::MAX_GRAPH, TSPOrdering *ordering = nullptr)
+		: _context(context), _cutoff_size(cutoff_size), _ordering(ordering) {}
+
+	template <typename Worker>
+	void execute(TSPPrefix &prefix, Worker &worker)
+	{
+		TSPPath path(prefix, &_context->graph());
+		// The budget is charged with the children spawned, fewer than the cities left
+		// when edges were eliminated. A prefix without any is solved (a dead end).
+		int children = 0;
+		if (worker.splitting() && path.size() < _cutoff_size && path.size() < path.full() &&
+			(children = _context->children(path)) > 0)
+		{
+			worker.split(children);
+			for (int i = 0; i < path.full(); i++)
+			{
+				if (!path.contains(i) && _context->candidate(path.tail(), i))
+				{
+					path.push(i);
+					worker.spawn(path.prefix());
+					path.pop();
+				}
+			}
+			return;
+		}
+
+		TSPTask task(_context, path, _cutoff_size, _ordering);
+		if (worker.dynamic())
+			worker.sliced([&task](long budget)
+						  { return task.resume(budget); },
+						  [&task](TSPPrefix &donated)
+						  {
+							  TSPPath p;
+							  if (!task.donate(p))
+								  return false;
+							  donated = p.prefix();
+							  return true;
+						  });
+		else
+			task.solve();
+	}
+};
+
+static_assert(std::is_trivially_copyable<TSPPrefix>::value, "TSPPrefix is copied by the deques");
+
+using TSPInlineRunner = BasicWorkStealingRunner<TSPPrefix, TSPPrefixOps>;
@@ -0,0 +1,189 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "tsptask.hpp"
+#include "tspinline.hpp"
+#include "tspautotune.hpp"
+
+// Portfolio mode: racers searching the whole tree with different branching orders
+// (see TSPOrdering), each one on its own group of workers, all publishing into the
+// best tour of one context so that every racer prunes with the best bound found by
+// any of them. The first racer to finish its search has proven the optimum and stops
+// the others. A RANDOM racer restarts with a new seed and twice the time whenever its
+// time runs out, as long as no other racer has finished. The threads are shared out
+// between the racers, with fewer threads than orders only the first orders race.
+//
+// The transposition table cannot be shared by racers: an entry of a racer still
+// exploring its subtree would let another one prune it and finish without proof.
+class TSPPortfolio : public RunTimer
+{
+public:
+	static constexpr double FIRST_RESTART = 0.01; // seconds of the first RANDOM run
+	static const int TASKS_PER_THREAD = 16;		  // split budget of a racer
+
+	struct Racer
+	{
+		TSPOrdering ordering;
+		unsigned threads = 0;
+		long restarts = 0;
+	};
+
+	TSPPortfolio(TSPContext &context, unsigned threads, const std::vector<TSPOrdering::Order> &orders)
+		: _context(context)
+	{
+		if (context.table())
+			throw std::runtime_error("The transposition table cannot be shared by the racers");
+		const unsigned racers = std::min<unsigned>(std::max(1u, threads), orders.size());
+		std::vector<int> position = farthestInsertion(context.graph());
+		for (unsigned r = 0; r < racers; r++)
+		{
+			_racers.emplace_back(new Racer);
+			Racer &racer = *_racers.back();
+			racer.ordering.order = orders[r];
+			racer.threads = threads / racers + (r < threads % racers); // at least one
+			for (int i = 0; i < context.size(); i++)
+				racer.ordering.position[i] = (uint8_t)position[i];
+		}
+	}
+
+	void run()
+	{
+		startTimer();
+		_start = TSPOrdering::now();
+		std::vector<std::thread> threads;
+		for (size_t r = 0; r < _racers.size(); r++)
+			threads.emplace_back(&TSPPortfolio::race, this, (int)r);
+		for (auto &t : threads)
+			t.join();
+		stopTimer();
+	}
+
+	const std::vector<std::unique_ptr<Racer>> &racers() const { return _racers; }
+
+	// The racer whose search completed, -1 before run()
+	int winner() const { return _winner.load(); }
+
+	// The racer that found the best tour first, -1 when none did
+	int incumbent() const
+	{
+		int best = -1;
+		for (size_t r = 0; r < _racers.size(); r++)
+		{
+			const TSPOrdering &o = _racers[r]->ordering;
+			if (o.found.load() == _context.bestDistance() &&
+				(best < 0 || o.found_at.load() < _racers[best]->ordering.found_at.load()))
+				best = (int)r;
+		}
+		return best;
+	}
+
+	// Seconds from the start of the run to an event of TSPOrdering::now()
+	double since(long time) const { return (time - _start) * 1e-9; }
+
+	static const char *name(TSPOrdering::Order order)
+	{
+		static const char *const names[] = {"nearest", "regret", "farthest", "random"};
+		return names[order];
+	}
+
+	// Comma separated names, false when one is unknown
+	static bool parse(const std::string &list, std::vector<TSPOrdering::Order> &orders)
+	{
+		std::istringstream in(list);
+		for (std::string item; std::getline(in, item, ',');)
+		{
+			int o = TSPOrdering::NEAREST;
+			while (o <= TSPOrdering::RANDOM && item != name((TSPOrdering::Order)o))
+				o++;
+			if (o > TSPOrdering::RANDOM)
+				return false;
+			orders.push_back((TSPOrdering::Order)o);
+		}
+		return !orders.empty();
+	}
+
+private:
+	TSPContext &_context;
+	std::vector<std::unique_ptr<Racer>> _racers;
+	std::atomic<int> _winner{-1};
+	long _start = 0;
+
+	void race(int r)
+	{
+		Racer &racer = *_racers[r];
+		TSPOrdering &o = racer.ordering;
+		const size_t budget = racer.threads > 1 ? racer.threads * TASKS_PER_THREAD : 1;
+		const int cutoff = TSPAutoTuner::cutoffFor(_context.size(), budget);
+		double limit = FIRST_RESTART;
+		while (true)
+		{
+			if (o.order == TSPOrdering::RANDOM)
+			{
+				o.seed = ((uint64_t)r << 32 | (uint64_t)racer.restarts) * 0x9E3779B97F4A7C15ull + 1;
+				o.deadline = TSPOrdering::now() + (long)(limit * 1e9);
+			}
+			TSPInlineRunner runner(racer.threads, budget, 1 << 16, TSPPrefixOps(&_context, cutoff, &o));
+			runner.setDynamicSplitting(true);
+			runner.run(_context.root().prefix());
+			if (o.stop.load())
+				return; // another racer finished first
+			if (o.deadline && TSPOrdering::now() > o.deadline)
+			{
+				racer.restarts++; // maybe cut: search again
+				limit *= 2;
+				continue;
+			}
+			int none = -1;
+			if (_winner.compare_exchange_strong(none, r))
+				for (auto &other : _racers)
+					other->ordering.stop.store(true);
+			return;
+		}
+	}
+
+	// Rank of each city in a farthest-insertion tour: the city farthest from the tour
+	// is inserted where it lengthens it the least
+	static std::vector<int> farthestInsertion(const TSPGraph &g)
+	{
+		const int n = g.size();
+		std::vector<int> tour = {0};
+		std::vector<int> gap(n); // distance from each city to the tour
+		std::vector<bool> in(n, false);
+		in[0] = true;
+		for (int i = 0; i < n; i++)
+			gap[i] = g.distance(0, i);
+		for (int step = 1; step < n; step++)
+		{
+			int far = -1;
+			for (int i = 0; i < n; i++)
+				if (!in[i] && (far < 0 || gap[i] > gap[far]))
+					far = i;
+			size_t at = 0;
+			long cheapest = LONG_MAX;
+			for (size_t k = 0; k < tour.size(); k++)
+			{
+				const int a = tour[k], b = tour[(k + 1) % tour.size()];
+				long extra = (long)g.distance(a, far) + g.distance(far, b) - (tour.size() > 1 ? g.distance(a, b) : 0);
+				if (extra < cheapest)
+				{
+					cheapest = extra;
+					at = k + 1;
+				}
+			}
+			tour.insert(tour.begin() + at, far);
+			in[far] = true;
+			for (int i = 0; i < n; i++)
+				gap[i] = std::min(gap[i], g.distance(far, i));
+		}
+		std::vector<int> position(n);
+		for (int k = 0; k < n; k++)
+			position[tour[k]] = k;
+		return position;
+	}
+};
@@ -0,0 +1,249 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <cmath>
+#include <vector>
+
+#include "tsptask.hpp"
+
+// Outcome of TSPEdgeReducer::reduce()
+struct TSPReduction
+{
+	int edges;			// undirected edges of the graph
+	int eliminated;		// edges proven absent from every optimal tour
+	double lower_bound; // best Held-Karp 1-tree bound
+	int upper_bound;	// heuristic tour length
+	int iterations;		// subgradient steps
+	double time;		// seconds
+};
+
+// Reduced-cost edge elimination. The Held-Karp bound (minimum 1-tree with Lagrangian
+// multipliers on the cities, found by subgradient steps) gives for each edge the
+// lower bound of the tours using it: the bound plus the reduced cost of the edge. An
+// edge whose bound exceeds the length of a heuristic tour is in no optimal tour.
+class TSPEdgeReducer
+{
+public:
+	static const int DEFAULT_ITERATIONS = 1000;
+
+	static TSPReduction reduce(const TSPGraph &g, TSPCandidates &candidates, int iterations = DEFAULT_ITERATIONS)
+	{
+		auto start = std::chrono::steady_clock::now();
+		const int n = g.size();
+		TSPReduction r = {};
+		r.edges = n * (n - 1) / 2;
+		r.upper_bound = heuristicTour(g);
+		std::vector<bool> kept(n * n, true);
+		if (n < 4) // every edge is in the only tours
+			iterations = 0;
+
+		// Subgradient ascent on the multipliers, keeping the best ones
+		std::vector<double> pi(n, 0.0), best_pi(pi);
+		OneTree tree;
+		double best = -1e300;
+		double lambda = 2;
+		int since_improvement = 0;
+		while (r.iterations < iterations)
+		{
+			++r.iterations;
+			double bound = oneTree(g, pi, tree);
+			if (bound > best + 1e-9)
+			{
+				best = bound;
+				best_pi = pi;
+				since_improvement = 0;
+			}
+			else if (++since_improvement >= n)
+			{
+				lambda /= 2;
+				since_improvement = 0;
+			}
+			double norm = 0;
+			for (int i = 0; i < n; ++i)
+				norm += (tree.degree[i] - 2) * (tree.degree[i] - 2);
+			if (norm == 0 || lambda < 1e-6 || best >= r.upper_bound)
+				break; // the 1-tree is a tour, or no more progress
+			const double step = lambda * (r.upper_bound - bound) / norm;
+			for (int i = 0; i < n; ++i)
+				pi[i] += step * (tree.degree[i] - 2);
+		}
+		r.lower_bound = r.iterations ? best : 0;
+
+		// Reduced costs with the best multipliers
+		const double slack = r.upper_bound - best + 1e-6 * r.upper_bound; // rounding margin
+		if (r.iterations > 0)
+			oneTree(g, best_pi, tree);
+		for (int i = 1; i < n && r.iterations > 0; ++i)
+		{
+			for (int j = i + 1; j < n; ++j)
+			{
+				double w = g.distance(i, j) + best_pi[i] + best_pi[j];
+				if (w - tree.heaviest[i * n + j] > slack)
+					kept[i * n + j] = kept[j * n + i] = false;
+			}
+			// Edges of the first city replace the second one it uses in the 1-tree
+			double w = g.distance(0, i) + best_pi[0] + best_pi[i];
+			if (w - tree.second > slack)
+				kept[i] = kept[i * n] = false;
+		}
+
+		for (int i = 0; i < n; ++i)
+		{
+			int m = 0;
+			candidates.mask[i] = 0;
+			for (int j = 0; j < n; ++j)
+			{
+				if (j == i || !kept[i * n + j])
+					continue;
+				candidates.mask[i] |= 1u << j;
+				candidates.node[i][m] = (uint8_t)j;
+				candidates.cost[i][m] = g.distance(i, j);
+				++m;
+			}
+			candidates.count[i] = (uint8_t)m;
+			// Sorted from the closest, as the search explores them
+			for (int a = 1; a < m; ++a)
+				for (int b = a; b > 0 && candidates.cost[i][b - 1] > candidates.cost[i][b]; --b)
+				{
+					std::swap(candidates.node[i][b - 1], candidates.node[i][b]);
+					std::swap(candidates.cost[i][b - 1], candidates.cost[i][b]);
+				}
+			r.eliminated += (n - 1) - m;
+		}
+		r.eliminated /= 2;
+
+		std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+		r.time = elapsed.count();
+		return r;
+	}
+
+private:
+	struct OneTree
+	{
+		int degree[TSPPath::MAX_GRAPH];
+		double heaviest[TSPPath::MAX_GRAPH * TSPPath::MAX_GRAPH]; // heaviest edge on the tree path i..j
+		double second;											  // second edge of the first city
+	};
+
+	// Minimum 1-tree for the costs d(i, j) + pi[i] + pi[j]: a spanning tree of the cities
+	// but the first one (Prim), plus the two shortest edges of the first city. Returns
+	// its Lagrangian bound, the tree length minus twice the sum of the multipliers.
+	static double oneTree(const TSPGraph &g, const std::vector<double> &pi, OneTree &t)
+	{
+		const int n = g.size();
+		auto w = [&](int i, int j)
+		{ return g.distance(i, j) + pi[i] + pi[j]; };
+
+		double total = 0;
+		double key[TSPPath::MAX_GRAPH];
+		int parent[TSPPath::MAX_GRAPH];
+		bool in[TSPPath::MAX_GRAPH] = {};
+		int order[TSPPath::MAX_GRAPH];
+		std::fill(t.degree, t.degree + n, 0);
+		for (int i = 1; i < n; ++i)
+		{
+			key[i] = w(1, i);
+			parent[i] = 1;
+		}
+		in[1] = true;
+		order[0] = 1;
+		t.heaviest[1 * n + 1] = 0;
+		for (int k = 1; k < n - 1; ++k)
+		{
+			int next = -1;
+			for (int i = 2; i < n; ++i)
+				if (!in[i] && (next < 0 || key[i] < key[next]))
+					next = i;
+			in[next] = true;
+			total += key[next];
+			t.degree[next]++;
+			t.degree[parent[next]]++;
+			// Heaviest edge from the cities already in the tree to the new one
+			for (int a = 0; a < k; ++a)
+			{
+				const int c = order[a];
+				double h = std::max(t.heaviest[c * n + parent[next]], key[next]);
+				t.heaviest[c * n + next] = t.heaviest[next * n + c] = h;
+			}
+			t.heaviest[next * n + next] = 0;
+			order[k] = next;
+			for (int i = 2; i < n; ++i)
+				if (!in[i] && w(next, i) < key[i])
+				{
+					key[i] = w(next, i);
+					parent[i] = next;
+				}
+		}
+
+		// The two shortest edges of the first city
+		int first = -1, second = -1;
+		for (int i = 1; i < n; ++i)
+		{
+			if (first < 0 || w(0, i) < w(0, first))
+			{
+				second = first;
+				first = i;
+			}
+			else if (second < 0 || w(0, i) < w(0, second))
+				second = i;
+		}
+		total += w(0, first) + w(0, second);
+		t.degree[0] = 2;
+		t.degree[first]++;
+		t.degree[second]++;
+		t.second = w(0, second);
+
+		for (int i = 0; i < n; ++i)
+			total -= 2 * pi[i];
+		return total;
+	}
+
+	// Best of the nearest-neighbour tours from every city, improved by 2-opt moves
+	// until none shortens them
+	static int heuristicTour(const TSPGraph &g)
+	{
+		const int n = g.size();
+		int best = INT_MAX;
+		std::vector<int> tour(n);
+		std::vector<bool> visited(n);
+		for (int s = 0; s < n; ++s)
+		{
+			std::fill(visited.begin(), visited.end(), false);
+			tour[0] = s;
+			visited[s] = true;
+			for (int k = 1; k < n; ++k)
+			{
+				int next = -1;
+				for (int i = 0; i < n; ++i)
+					if (!visited[i] && (next < 0 || g.distance(tour[k - 1], i) < g.distance(tour[k - 1], next)))
+						next = i;
+				tour[k] = next;
+				visited[next] = true;
+			}
+			bool improved = true;
+			while (improved)
+			{
+				improved = false;
+				for (int i = 0; i < n - 1; ++i)
+					for (int j = i + 2; j < n; ++j)
+					{
+						const int a = tour[i], b = tour[i + 1], c = tour[j], d = tour[(j + 1) % n];
+						if (a == d)
+							continue;
+						if (g.distance(a, c) + g.distance(b, d) < g.distance(a, b) + g.distance(c, d))
+						{
+							std::reverse(tour.begin() + i + 1, tour.begin() + j + 1);
+							improved = true;
+						}
+					}
+			}
+			int length = 0;
+			for (int i = 0; i < n; ++i)
+				length += g.distance(tour[i], tour[(i + 1) % n]);
+			best = std::min(best, length);
+		}
+		return best;
+	}
+};
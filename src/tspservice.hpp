@@ -0,0 +1,328 @@
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <type_traits>
+
+#include "tsptask.hpp"
+#include "workstealing.hpp"
+#include "tspautotune.hpp"
+#include "tspreduce.hpp"
+
+// One solve in progress on a TSPService pool, with its own context: its best tour and
+// bound are not shared with the other requests
+struct TSPRequest
+{
+	using Clock = std::chrono::steady_clock;
+
+	struct Result
+	{
+		long id;
+		std::string name;
+		int size;
+		std::string status; // ok, or deadline when the search was cut
+		double queue_time;	// seconds from the request to its first task
+		double solve_time;	// seconds from its first task to its last one
+		double latency;		// seconds from the request to the end
+		int distance;
+		std::string path;
+	};
+
+	long id;
+	std::shared_ptr<const TSPGraph> graph;
+	TSPCandidates candidates;
+	TSPContext context;
+	int cutoff_size;
+	size_t budget;
+	std::atomic<long> created{1}; // tasks created by splitting, splitting stops at the budget
+	std::atomic<long> pending{1}; // tasks not finished, the root included
+	std::atomic<bool> started{false};
+	std::atomic<bool> cut{false};
+	Clock::time_point received, start, deadline;
+	bool has_deadline;
+	std::function<void(const Result &)> done;
+
+	TSPRequest(long id, std::shared_ptr<const TSPGraph> g, double deadline_seconds)
+		: id(id), graph(std::move(g)), context(graph.get()), received(Clock::now()), has_deadline(deadline_seconds > 0)
+	{
+		deadline = received + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(deadline_seconds));
+	}
+
+	// The first task ends the queueing time
+	void begin()
+	{
+		if (!started.load(std::memory_order_relaxed) && !started.exchange(true, std::memory_order_relaxed))
+			start = Clock::now();
+	}
+
+	bool expired()
+	{
+		if (!has_deadline || Clock::now() < deadline)
+			return false;
+		cut.store(true, std::memory_order_relaxed);
+		return true;
+	}
+
+	// Soft budget: a split is accepted while the budget is not reached
+	bool split(int n)
+	{
+		if (created.load(std::memory_order_relaxed) >= (long)budget)
+			return false;
+		created.fetch_add(n - 1, std::memory_order_relaxed);
+		return true;
+	}
+
+	// One task is done, the last one reports the result (and the request may be deleted)
+	void finish()
+	{
+		if (pending.fetch_sub(1, std::memory_order_acq_rel) != 1)
+			return;
+		auto end = Clock::now();
+		Result r;
+		r.id = id;
+		r.name = graph->filename();
+		r.size = graph->size();
+		r.status = cut.load(std::memory_order_relaxed) ? "deadline" : "ok";
+		r.queue_time = std::chrono::duration<double>(start - received).count();
+		r.solve_time = std::chrono::duration<double>(end - start).count();
+		r.latency = std::chrono::duration<double>(end - received).count();
+		const TSPPath &best = context.result();
+		r.distance = best.size() ? best.distance() : -1;
+		std::ostringstream os;
+		os << best;
+		r.path = os.str();
+		auto callback = std::move(done); // it may delete this request
+		callback(r);
+	}
+};
+
+// A prefix of a request, stored by value in the deques of the pool
+struct TSPJob
+{
+	TSPPrefix prefix;
+	TSPRequest *request;
+};
+
+static_assert(std::is_trivially_copyable<TSPJob>::value, "TSPJob is copied by the deques");
+
+// TSPPrefixOps for many requests at once: the split budget, the deadline and the end
+// of the run are per request
+struct TSPServiceOps
+{
+	template <typename Worker>
+	void execute(TSPJob &job, Worker &worker)
+	{
+		TSPRequest &r = *job.request;
+		r.begin();
+		if (!r.expired())
+		{
+			TSPPath path(job.prefix, r.graph.get());
+			int children = 0; // spawned below, fewer than the cities left with --reduce
+			if (path.size() < r.cutoff_size && path.size() < path.full() &&
+				(children = r.context.children(path)) > 0 && r.split(children))
+			{
+				for (int i = 0; i < path.full(); i++)
+				{
+					if (!path.contains(i) && r.context.candidate(path.tail(), i))
+					{
+						path.push(i);
+						r.pending.fetch_add(1, std::memory_order_relaxed);
+						worker.spawn({path.prefix(), &r});
+						path.pop();
+					}
+				}
+			}
+			else
+			{
+				TSPTask task(&r.context, path, r.cutoff_size);
+				worker.sliced([&task, &r](long budget)
+							  { return r.expired() || task.resume(budget); },
+							  [&task, &r](TSPJob &donated)
+							  {
+								  TSPPath p;
+								  if (!task.donate(p))
+									  return false;
+								  r.pending.fetch_add(1, std::memory_order_relaxed);
+								  donated = {p.prefix(), &r};
+								  return true;
+							  });
+			}
+		}
+		r.finish();
+	}
+};
+
+// Resident solver: a warm pool of workers shared by the requests, and the graphs
+// already loaded. Requests are solved concurrently; a new one starts within a slice
+// even when older ones keep every worker busy (see BasicWorkStealingRunner::sliced).
+class TSPService
+{
+public:
+	using Result = TSPRequest::Result;
+
+	static const int TASKS_PER_THREAD = 4; // split budget of a request
+	static const size_t MAX_GRAPHS = 64;
+
+	struct Metrics
+	{
+		long requests = 0;
+		double total_latency = 0, max_latency = 0;
+		double total_queue = 0, max_queue = 0;
+		size_t graphs = 0;
+	};
+
+	TSPService(unsigned threads, bool reduce)
+		: _threads(std::max(1u, threads)), _reduce(reduce), _pool(_threads, 1)
+	{
+		_pool.setDynamicSplitting(true);
+		_pool.start();
+	}
+
+	~TSPService() { _pool.shutdown(); }
+
+	unsigned threads() const { return _threads; }
+
+	// The first `size` cities (0: all) of a file, loaded once for every size: the
+	// result is a view holding the whole graph. A file is loaded without the lock of the
+	// cache, the requests of other files do not wait for it.
+	std::shared_ptr<const TSPGraph> graph(const std::string &file, int size)
+	{
+		if (size > TSPPath::MAX_GRAPH)
+			throw std::runtime_error("Graph bigger than MAX_GRAPH");
+		std::promise<std::shared_ptr<TSPGraph>> promise;
+		std::shared_future<std::shared_ptr<TSPGraph>> loaded;
+		bool load = false;
+		{
+			std::lock_guard<std::mutex> lock(_graphs_mutex);
+			auto it = _graphs.find(file);
+			if (it == _graphs.end())
+			{
+				evict();
+				it = _graphs.emplace(file, CachedGraph{promise.get_future().share(), 0}).first;
+				load = true;
+			}
+			it->second.last_use = ++_uses;
+			loaded = it->second.graph;
+		}
+		if (load)
+		{
+			try
+			{
+				promise.set_value(std::make_shared<TSPGraph>(file));
+			}
+			catch (...)
+			{
+				// Not cached: a later request tries again
+				{
+					std::lock_guard<std::mutex> lock(_graphs_mutex);
+					_graphs.erase(file);
+				}
+				promise.set_exception(std::current_exception());
+			}
+		}
+		std::shared_ptr<TSPGraph> whole = loaded.get(); // waits for a load in progress
+		if (size <= 0)
+			size = whole->dimension();
+		if (size > TSPPath::MAX_GRAPH)
+			throw std::runtime_error("Graph bigger than MAX_GRAPH");
+		return std::shared_ptr<const TSPGraph>(new TSPGraph(*whole, size), [whole](const TSPGraph *view)
+											   { delete view; });
+	}
+
+	// Solve on the pool, done(result) is called by the worker finishing the request
+	void solve(std::shared_ptr<const TSPGraph> graph, double deadline, std::function<void(const Result &)> done)
+	{
+		TSPRequest *r = new TSPRequest(_next_id.fetch_add(1, std::memory_order_relaxed), std::move(graph), deadline);
+		if (_reduce)
+		{
+			TSPEdgeReducer::reduce(*r->graph, r->candidates);
+			r->context.setCandidates(&r->candidates);
+		}
+		r->budget = _threads > 1 ? _threads * TASKS_PER_THREAD : 1;
+		r->cutoff_size = TSPAutoTuner::cutoffFor(r->graph->size(), r->budget);
+		r->done = [this, r, done](const Result &result)
+		{
+			record(result);
+			done(result);
+			delete r;
+		};
+		_pool.submit({r->context.root().prefix(), r});
+	}
+
+	// Same, waiting for the result
+	Result solve(std::shared_ptr<const TSPGraph> graph, double deadline)
+	{
+		std::promise<Result> promise;
+		auto future = promise.get_future();
+		solve(std::move(graph), deadline, [&promise](const Result &r)
+			  { promise.set_value(r); });
+		return future.get();
+	}
+
+	Metrics metrics()
+	{
+		std::lock_guard<std::mutex> lock(_metrics_mutex);
+		Metrics m = _metrics;
+		std::lock_guard<std::mutex> graphs_lock(_graphs_mutex);
+		m.graphs = _graphs.size();
+		return m;
+	}
+
+private:
+	struct CachedGraph
+	{
+		std::shared_future<std::shared_ptr<TSPGraph>> graph; // ready once loaded
+		long last_use;
+	};
+
+	unsigned _threads;
+	bool _reduce;
+	BasicWorkStealingRunner<TSPJob, TSPServiceOps> _pool;
+	std::atomic<long> _next_id{1};
+
+	std::mutex _graphs_mutex;
+	std::map<std::string, CachedGraph> _graphs;
+	long _uses = 0;
+
+	std::mutex _metrics_mutex;
+	Metrics _metrics;
+
+	// Drop the least recently used graph no request holds when the cache is full, a
+	// graph being loaded is held by its request
+	void evict()
+	{
+		if (_graphs.size() < MAX_GRAPHS)
+			return;
+		auto victim = _graphs.end();
+		for (auto it = _graphs.begin(); it != _graphs.end(); ++it)
+			if (it->second.graph.wait_for(std::chrono::seconds(0)) == std::future_status::ready &&
+				it->second.graph.get().use_count() == 1 &&
+				(victim == _graphs.end() || it->second.last_use < victim->second.last_use))
+				victim = it;
+		if (victim != _graphs.end())
+			_graphs.erase(victim);
+	}
+
+	void record(const Result &r)
+	{
+		std::lock_guard<std::mutex> lock(_metrics_mutex);
+		_metrics.requests++;
+		_metrics.total_latency += r.latency;
+		_metrics.max_latency = std::max(_metrics.max_latency, r.latency);
+		_metrics.total_queue += r.queue_time;
+		_metrics.max_queue = std::max(_metrics.max_queue, r.queue_time);
+	}
+};
+
+// One CSV line per result: id;name;size;status;queue_time;solve_time;latency;[path];
+inline std::ostream &operator<<(std::ostream &os, const TSPRequest::Result &r)
+{
+	return os << r.id << ';' << r.name << ';' << r.size << ';' << r.status << ';'
+			  << r.queue_time << ';' << r.solve_time << ';' << r.latency << ';' << r.path << ';';
+}
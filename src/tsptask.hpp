@@ -1,9 +1,30 @@
+#pragma once
+
 #include <bitset>
 #include <climits>
 #include <atomic>
+#include <mutex>
+#include <utility>
+#include <memory>
+#include <cstdint>
+#include <chrono>
 
 #include "tspgraph.hpp"
 #include "task.hpp"
+#include "tsptt.hpp"
+
+// A path packed in a few words (5 bits per node), trivially copyable so that the
+// inline work-stealing deques can store it by value (see tspinline.hpp)
+struct TSPPrefix
+{
+	uint64_t nodes[3];
+	uint32_t visited;
+	int32_t distance;
+	uint8_t size;
+
+	int node(int i) const { return (int)((nodes[i / 12] >> (5 * (i % 12))) & 31); }
+	void setNode(int i, int node) { nodes[i / 12] |= (uint64_t)node << (5 * (i % 12)); }
+};
 
 class TSPPath
 {
@@ -12,22 +33,21 @@ public:
 	static const int MAX_GRAPH = 32;
 
 private:
-	static TSPGraph *_graph;
-	int _node[MAX_GRAPH];
+	const TSPGraph *_graph = nullptr;
+	int _node[MAX_GRAPH + 1]; // + the first node again when the loop is closed
 	int _size;
 	int _distance;
 	std::bitset<MAX_GRAPH> _contents;
 
 public:
-	static void setup(TSPGraph *graph)
-	{
-		_graph = graph;
-		if (_graph->size() > MAX_GRAPH)
-			throw std::runtime_error("Graph bigger than MAX_GRAPH");
-	}
-	static int full() { return _graph->size(); } // the size of a full path
+	int full() const { return _graph->size(); } // the size of a full path
+	const TSPGraph &graph() const { return *_graph; }
+
+	// Empty path, only to be assigned
+	TSPPath() : _size(0), _distance(0) {}
 
-	TSPPath()
+	// The path holding only FIRST_NODE
+	explicit TSPPath(const TSPGraph *graph) : _graph(graph)
 	{
 		_node[0] = FIRST_NODE;
 		_size = 1;
@@ -36,11 +56,56 @@ public:
 		_contents.set(FIRST_NODE);
 	}
 
+	// The first `size` nodes of another path
+	TSPPath(const TSPPath &path, int size) : TSPPath(path._graph)
+	{
+		for (int i = 1; i < size; i++)
+			append(path._node[i], cost(path._node[i]));
+	}
+
+	TSPPath(const TSPPrefix &prefix, const TSPGraph *graph) : _graph(graph)
+	{
+		_size = prefix.size;
+		_distance = prefix.distance;
+		_contents = std::bitset<MAX_GRAPH>(prefix.visited);
+		for (int i = 0; i < _size; i++)
+			_node[i] = prefix.node(i);
+	}
+
+	TSPPrefix prefix() const
+	{
+		static_assert(MAX_GRAPH <= 32, "5 bits per node");
+		TSPPrefix p = {};
+		p.size = (uint8_t)_size;
+		p.distance = _distance;
+		p.visited = (uint32_t)_contents.to_ulong();
+		for (int i = 0; i < _size; i++)
+			p.setNode(i, _node[i]);
+		return p;
+	}
+
 	void maximise() { _distance = INT_MAX; }
-	int size() { return _size; }
-	int distance() { return _distance; }
-	bool contains(int i) { return _contents.test(i); }
-	int tail() { return _node[_size - 1]; }
+	int size() const { return _size; }
+	int distance() const { return _distance; }
+	bool contains(int i) const { return _contents.test(i); }
+	uint32_t visited() const { return (uint32_t)_contents.to_ulong(); }
+	int tail() const { return _node[_size - 1]; }
+	int node(int i) const { return _node[i]; }
+
+	// Unchecked push/pop for the search kernels: cost is the distance from the tail,
+	// and node must not be FIRST_NODE (it stays in _contents when the loop is closed)
+	int cost(int node) const { return _graph->distance(tail(), node); }
+	void append(int node, int cost)
+	{
+		_distance += cost;
+		_contents.set(node);
+		_node[_size++] = node;
+	}
+	void remove(int cost)
+	{
+		_contents.reset(_node[--_size]);
+		_distance -= cost;
+	}
 
 	void push(int node)
 	{
@@ -82,25 +147,152 @@ std::ostream &operator<<(std::ostream &os, const TSPPath &t)
 	return os;
 }
 
+// The edges a search may follow from each city, sorted from the shortest. Built by
+// TSPEdgeReducer (tspreduce.hpp) without the edges proven absent from optimal tours.
+struct TSPCandidates
+{
+	uint32_t mask[TSPPath::MAX_GRAPH]; // bit j of mask[i]: edge (i, j) kept
+	uint8_t count[TSPPath::MAX_GRAPH];
+	uint8_t node[TSPPath::MAX_GRAPH][TSPPath::MAX_GRAPH];
+	int cost[TSPPath::MAX_GRAPH][TSPPath::MAX_GRAPH];
+};
+
+// Branching order of the searches of one racer of a portfolio (see tspportfolio.hpp),
+// the searches without one explore the candidates from the closest. It also stops the
+// racer and records the tours it published.
+struct TSPOrdering
+{
+	enum Order
+	{
+		NEAREST,  // closest city first
+		REGRET,   // first the cities that would cost the most to reach later
+		FARTHEST, // along a farthest-insertion tour
+		RANDOM    // closest first, the costs perturbed by up to a quarter
+	};
+
+	Order order = NEAREST;
+	uint64_t seed = 0;							// RANDOM: a new one per restart
+	uint8_t position[TSPPath::MAX_GRAPH] = {}; // FARTHEST: rank of each city in the tour
+	long deadline = 0;							// steady clock nanoseconds, 0 for none
+	std::atomic<bool> stop{false};
+
+	// Best distance published by this racer, and when
+	std::atomic<int> found{INT_MAX};
+	std::atomic<long> found_at{0};
+	std::atomic<long> improvements{0};
+
+	static long now() { return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count(); }
+
+	// Stopped by the portfolio, or past the deadline of a restart
+	bool stopped() const { return stop.load(std::memory_order_relaxed) || (deadline && now() > deadline); }
+
+	void publish(int distance)
+	{
+		improvements.fetch_add(1, std::memory_order_relaxed);
+		for (int f = found.load(std::memory_order_relaxed); distance < f;)
+			if (found.compare_exchange_weak(f, distance, std::memory_order_relaxed))
+			{
+				found_at.store(now(), std::memory_order_relaxed);
+				break;
+			}
+	}
+};
+
+class TSPTask;
+
+// The state shared by the tasks of one solve: the graph, the best tour and its bound,
+// the statistics and the search settings. Every TSPTask keeps a pointer to its context,
+// so that several solves can run at once in one process.
+class TSPContext
+{
+public:
+	using Kernel = bool (TSPTask::*)(long);
+	static const int DEFAULT_BOUND_REFRESH = 256;
+
+	explicit TSPContext(const TSPGraph *graph);
+	TSPContext(const TSPContext &) = delete;
+	TSPContext &operator=(const TSPContext &) = delete;
+
+	const TSPGraph &graph() const { return *_graph; }
+	int size() const { return _graph->size(); }
+	TSPPath root() const { return TSPPath(_graph); } // the path every solve starts from
+
+	// Choose the kernel used by the searches: the one specialised for n cities when it
+	// exists (returns true), the generic one otherwise
+	bool selectKernel(int n);
+
+	// Forget the best path and the statistics of a previous solve
+	void reset()
+	{
+		{
+			std::lock_guard<std::mutex> lock(_best_mutex);
+			_best = TSPPath();
+			_best_dist.store(INT_MAX, std::memory_order_relaxed);
+		}
+		_nodes.store(0, std::memory_order_relaxed);
+		_stale_nodes.store(0, std::memory_order_relaxed);
+		if (_table)
+			_table->clear();
+	}
+
+	// The best tour found, an empty path when there is none. To be read once the
+	// searches are over.
+	const TSPPath &result() const { return _best; }
+	int bestDistance() const { return _best_dist.load(std::memory_order_acquire); }
+
+	void setBoundRefresh(int nodes) { _bound_refresh = std::max(1, nodes); }
+	int boundRefresh() const { return _bound_refresh; }
+	void setMeasure(bool measure) { _measure = measure; }
+	long nodes() const { return _nodes.load(std::memory_order_relaxed); }
+	long staleNodes() const { return _stale_nodes.load(std::memory_order_relaxed); }
+	void setTable(TSPTranspositionTable *table) { _table = table; }
+	TSPTranspositionTable *table() const { return _table; }
+	void setCandidates(const TSPCandidates *candidates) { _candidates = candidates; }
+	// Whether a search may go from city `from` to city `to`
+	bool candidate(int from, int to) const { return !_candidates || (_candidates->mask[from] >> to & 1); }
+	// The cities a search may append to path
+	int children(const TSPPath &path) const
+	{
+		int count = 0;
+		for (int i = 0; i < path.full(); i++)
+			count += !path.contains(i) && candidate(path.tail(), i);
+		return count;
+	}
+
+private:
+	friend class TSPTask;
+
+	const TSPGraph *_graph;
+	// The best tour by value, replaced under _best_mutex: new bests are rare, and no
+	// replaced tour is left to free in a resident service
+	std::mutex _best_mutex;
+	TSPPath _best;
+	// Distance of _best, written under _best_mutex, read without it so that workers
+	// refresh their bound with one load
+	alignas(64) std::atomic<int> _best_dist{INT_MAX};
+
+	// A search reloads its bound every _bound_refresh nodes instead of after every subtree
+	int _bound_refresh = DEFAULT_BOUND_REFRESH;
+	// Statistics, flushed once per search() call. With _measure the search also counts
+	// the nodes it explored only because its bound was stale.
+	bool _measure = false;
+	alignas(64) std::atomic<long> _nodes{0};
+	std::atomic<long> _stale_nodes{0};
+	// Dominance table shared by the searches, nullptr when disabled
+	TSPTranspositionTable *_table = nullptr;
+	// Candidate edges, nullptr when every edge is followed
+	const TSPCandidates *_candidates = nullptr;
+	Kernel _kernel;
+};
+
 class TSPTask : public Task
 {
 
 private:
+	TSPContext *_context; // cached by each task, the searches read it like statics
 	int _cutoff_size;
-	// static TSPPath _shortest;
-	static std::atomic<TSPPath *> _best;
-	// static std::vector<TSPTask *> _free_list;
-
-	// static TSPTask *alloc(const TSPPath &path, int node)
-	// {
-	// 	if (_free_list.empty())
-	// 		return new TSPTask(path, node);
-	// 	TSPTask *p = _free_list.back();
-	// 	_free_list.pop_back();
-	// 	p->_path = path;
-	// 	p->_path.push(node);
-	// 	return p;
-	// }
+	TSPOrdering *_ordering = nullptr; // nullptr: closest first, never stopped
+	bool _reorder = false;			  // an order other than closest first
 
 	// To be thread-safe
 	TSPTask *resusealloc(int node)
@@ -108,12 +300,6 @@ private:
 		return new TSPTask(this, node);
 	}
 
-	// static void free(TSPTask *p)
-	// {
-	// 	//        	delete p;
-	// 	_free_list.push_back(p);
-	// }
-
 	// TO be thread-safe
 	void reusefree(TSPTask *p)
 	{
@@ -122,61 +308,50 @@ private:
 
 	TSPPath _path;
 
-	// TSPTask(const TSPPath &path, int node) : _path(path)
-	// {
-	// 	_path.push(node);
-	// }
-	TSPTask(TSPTask *task, int node) : _path(task->_path), _cutoff_size(task->_cutoff_size)
+	// One level of the explicit search stack: the candidates following the path
+	// prefix of this depth, sorted from the closest, [cursor, count) still unexplored
+	struct Frame
+	{
+		uint8_t cursor;
+		uint8_t count;
+		uint8_t node[TSPPath::MAX_GRAPH];
+		int cost[TSPPath::MAX_GRAPH];
+	};
+	std::unique_ptr<Frame[]> _frames; // allocated by the first search() call
+	int _root_size = 0;				  // path size when the search started, frame 0 extends it
+	int _depth = -1;				  // top frame, -1 when the search is not started or finished
+
+	TSPTask(TSPTask *task, int node) : _context(task->_context), _cutoff_size(task->_cutoff_size), _ordering(task->_ordering), _reorder(task->_reorder), _path(task->_path)
 	{
 		_path.push(node);
 	}
 
 public:
-	// TSPTask(int cutoff)
-	// {
-	// 	_shortest.maximise();
-	// 	_cutoff_size = TSPPath::full() - cutoff;
-	// }
-	TSPTask() { _cutoff_size = TSPPath::full(); }
+	// The whole search. Tasks whose path has cutoff_size nodes or more are not split any further.
+	explicit TSPTask(TSPContext *context, int cutoff_size = TSPPath::MAX_GRAPH) : TSPTask(context, context->root(), cutoff_size) {}
+	TSPTask(TSPContext *context, const TSPPath &path, int cutoff_size, TSPOrdering *ordering = nullptr)
+		: _context(context), _cutoff_size(std::max(1, std::min(cutoff_size, context->size()))), _ordering(ordering),
+		  _reorder(ordering && ordering->order != TSPOrdering::NEAREST), _path(path) {}
 	~TSPTask() override = default;
 
-	// int size()
-	// {
-	// 	return TSPPath::full();
-	// }
+	// Graph sizes having a kernel specialised at compile time
+	static const int MIN_KERNEL = 12;
+	static const int MAX_KERNEL = 20;
 
-	TSPPath &result()
+	const TSPPath &result() const
 	{
-		// return _shortest;
-		TSPPath *p = _best.load(std::memory_order_acquire);
-		static TSPPath dummy;
-		return p ? *p : dummy;
+		return _context->result();
 	}
 
 	// Task interface implementation: split, merge, solve, write
-
-	// int split(Task **partitions, int size) override
-	// {
-	// 	if (_path.size() >= _cutoff_size || size < TSPPath::full())
-	// 		return 0;
-	// 	int count = 0;
-	// 	for (int i = 0; i < TSPPath::full(); i++)
-	// 	{
-	// 		if (!_path.contains(i))
-	// 			//				partitions[count ++] = new TSPTask(_path, i);
-	// 			partitions[count++] = TSPTask::alloc(_path, i);
-	// 	}
-	// 	return count;
-	// }
-
 	int split(TaskCollection *collection) override
 	{
 		if (_path.size() >= _cutoff_size)
 			return 0;
 		int count = 0;
-		for (int i = 0; i < TSPPath::full(); i++)
+		for (int i = 0; i < _path.full(); i++)
 		{
-			if (!_path.contains(i))
+			if (!_path.contains(i) && _context->candidate(_path.tail(), i))
 			{
 				TSPTask *t = resusealloc(i);
 				collection->push(t);
@@ -186,151 +361,339 @@ public:
 		return count;
 	}
 
-	// void merge(Task **partitions, int size) override
-	// {
-	// 	for (int p = 0; p < size; p++)
-	// 	{
-	// 		TSPTask *t = (TSPTask *)partitions[p];
-	// 		//			delete t;
-	// 		TSPTask::free(t);
-	// 		partitions[p] = nullptr;
-	// 	}
-	// }
-
 	void merge(TaskCollection *collection) override
 	{
-		for (int p = 0; p < collection->size(); p++)
+		// The best path is shared, there is nothing to combine: just free the children
+		while (collection->size())
 		{
 			TSPTask *t = (TSPTask *)collection->pop();
 			reusefree(t);
 		}
 	}
 
-	// void solve() override
-	// {
-	// 	//		std::cout << "solving " << _path << "\n";
-	// 	if (_path.size() == TSPPath::full())
-	// 	{
-	// 		_path.push(TSPPath::FIRST_NODE); // last node = first node
-	// 		if (_path.distance() < _shortest.distance())
-	// 			_shortest = _path;
-	// 		_path.pop();
-	// 	}
-	// 	else
-	// 	{
-	// 		for (int i = 0; i < TSPPath::full(); i++)
-	// 		{
-	// 			if (!_path.contains(i))
-	// 			{
-	// 				_path.push(i);
-	// 				if (_path.distance() < _shortest.distance())
-	// 					solve();
-	// 				_path.pop();
-	// 			}
-	// 		}
-	// 	}
-	// }
-
 	void solve() override
 	{
-		if (_path.size() == TSPPath::full())
+		(this->*_context->_kernel)(LONG_MAX);
+	}
+
+	// Explore at most `budget` nodes, returns false when the search is paused
+	// before the end of the subtree, a later call resumes it where it stopped
+	bool resume(long budget) override
+	{
+		return (this->*_context->_kernel)(budget);
+	}
+
+	// Give away the shallowest unexplored candidate of a paused search as a new task,
+	// so that the biggest subtree goes to the thief. nullptr when nothing is left.
+	TSPTask *donate() override
+	{
+		TSPPath path;
+		return donate(path) ? new TSPTask(_context, path, _cutoff_size, _ordering) : nullptr;
+	}
+
+	// Same, giving only the path of the donated subtree
+	bool donate(TSPPath &path)
+	{
+		for (int d = 0; d < _depth; ++d) // the top frame is about to be explored by its owner
 		{
-			// When all cities are already in the path
-			_path.push(TSPPath::FIRST_NODE); // close the visiting loop
-			const int d = _path.distance();
+			Frame &f = _frames[d];
+			if (f.cursor < f.count)
+			{
+				path = TSPPath(_path, _root_size + d);
+				path.push(f.node[--f.count]);
+				return true;
+			}
+		}
+		return false;
+	}
 
-			while (true)
+	// Branch and bound below the current path with an explicit stack of frames.
+	// N is the graph size known at compile time, so that the candidate loops are
+	// sized and unrolled by the compiler; N = 0 is the generic kernel reading the
+	// size at runtime.
+	template <int N>
+	bool search(long budget)
+	{
+		const int n = N ? N : _path.full();
+		TSPContext &context = *_context;
+		const TSPCandidates *const candidates = context._candidates;
+		if (_ordering && _ordering->stopped())
+			return true; // the race is over for this racer: drop the subtree
+		if (!_frames)
+		{
+			if (_path.size() == n)
 			{
-				TSPPath *current = _best.load(std::memory_order_acquire);
-				const int curr_best_dist = current ? current->distance() : INT_MAX;
+				closeLoop();
+				return true;
+			}
+			_frames.reset(new Frame[n - _path.size()]);
+			_root_size = _path.size();
+			_depth = 0;
+			expand<N>(_frames[0], candidates);
+		}
 
-				if (d >= curr_best_dist)
+		// Work on locals, written back only when pausing. The bound is a private copy
+		// refreshed every _bound_refresh nodes, a stale bound only prunes less.
+		Frame *frames = _frames.get();
+		int depth = _depth;
+		const int refresh_interval = context._bound_refresh;
+		const bool measure = context._measure;
+		TSPTranspositionTable *const table = context._table;
+		long lookups = 0, hits = 0, prunes = 0;
+		int best = context._best_dist.load(std::memory_order_relaxed);
+		int refresh = refresh_interval;
+		long nodes = 0, stale = 0;
+		while (depth >= 0)
+		{
+			Frame &f = frames[depth];
+			if (f.cursor == f.count)
+			{
+				// Subtree done: back to the parent frame
+				if (--depth >= 0)
+				{
+					Frame &parent = frames[depth];
+					_path.remove(parent.cost[parent.cursor - 1]);
+				}
+				continue;
+			}
+			if (budget-- <= 0)
+			{
+				_depth = depth;
+				flushStats(nodes, stale);
+				if (table)
+					table->count(lookups, hits, prunes);
+				return false;
+			}
+			if (--refresh == 0)
+			{
+				best = context._best_dist.load(std::memory_order_relaxed);
+				refresh = refresh_interval;
+				if (_ordering && _ordering->stopped())
 					break;
+			}
 
-				TSPPath *candidate = new TSPPath(_path);
-
-				if (_best.compare_exchange_weak(current, candidate, std::memory_order_acq_rel, std::memory_order_acquire))
+			const int k = f.cursor++;
+			_path.append(f.node[k], f.cost[k]);
+			++nodes;
+			if (_path.distance() >= best)
+			{
+				_path.remove(f.cost[k]); // pruning
+				continue;
+			}
+			if (measure && _path.distance() >= context._best_dist.load(std::memory_order_relaxed))
+				++stale;
+			if (_path.size() == n)
+			{
+				best = closeLoop();
+				_path.remove(f.cost[k]);
+			}
+			else if (table && table->covers(_path.size()))
+			{
+				// Another prefix already reached the same cities and tail at no higher cost
+				++lookups;
+				auto r = table->admit(_path.visited(), _path.tail(), _path.distance());
+				if (r == TSPTranspositionTable::PRUNE)
 				{
-					break;
+					++prunes;
+					_path.remove(f.cost[k]);
+					continue;
 				}
-
-				delete candidate;
+				hits += r == TSPTranspositionTable::HIT;
+				expand<N>(frames[++depth], candidates);
 			}
-			_path.pop();
-			return;
+			else
+				expand<N>(frames[++depth], candidates);
 		}
-		else
-		{
-			// When there is missing cities in the path -> explore next cities in an orderly and careful manner
-			const int N = TSPPath::full();
+		flushStats(nodes, stale);
+		if (table)
+			table->count(lookups, hits, prunes);
+		_depth = -1;
+		_frames.reset();
+		return true;
+	}
+
+	void write(std::ostream &os) const override
+	{
+		std::cout << "Task" << _path;
+	}
 
-			// 1) Build the list of city candidates not already visited
-			int candidates[TSPPath::MAX_GRAPH];
-			int extra_dists[TSPPath::MAX_GRAPH];
-			int m = 0;
+	int currentBestDist() const
+	{
+		return _context->bestDistance();
+	}
 
-			const int base = _path.distance();
-			for (int i = 0; i < N; ++i)
+private:
+	// Fill a frame with the cities not yet in the path, sorted from the closest to the tail
+	template <int N>
+	void expand(Frame &f, const TSPCandidates *candidates)
+	{
+		const int n = N ? N : _path.full();
+		int m = 0;
+		if (candidates)
+		{
+			// Already sorted by cost
+			const int tail = _path.tail();
+			const int count = candidates->count[tail];
+			for (int c = 0; c < count; ++c)
 			{
+				const int i = candidates->node[tail][c];
 				if (!_path.contains(i))
 				{
-					_path.push(i);
-					extra_dists[m] = _path.distance() - base;
-					_path.pop();
-					candidates[m] = i;
+					f.cost[m] = candidates->cost[tail][c];
+					f.node[m] = (uint8_t)i;
 					++m;
 				}
 			}
-
-			// 2) Sort the candidates from the closest city to the furthest
-			for (int a = 1; a < m; ++a)
+			f.cursor = 0;
+			f.count = (uint8_t)m;
+			if (_reorder)
+				reorder(f);
+			return;
+		}
+		for (int i = 0; i < n; ++i)
+		{
+			if (!_path.contains(i))
 			{
-				int key_node = candidates[a];
-				int key_extra_dist = extra_dists[a];
-				int b = a - 1;
-				while (b >= 0 && extra_dists[b] > key_extra_dist)
-				{
-					candidates[b + 1] = candidates[b];
-					extra_dists[b + 1] = extra_dists[b];
-					--b;
-				}
-				candidates[b + 1] = key_node;
-				extra_dists[b + 1] = key_extra_dist;
+				f.cost[m] = _path.cost(i);
+				f.node[m] = (uint8_t)i;
+				++m;
 			}
+		}
+		if (_reorder)
+		{
+			f.cursor = 0;
+			f.count = (uint8_t)m;
+			reorder(f);
+			return;
+		}
 
-			// 3) Explore the sorted candidates and
-			int best = currentBestDist();
-			for (int k = 0; k < m; ++k)
+		// Insertion sort, the lists are short
+		for (int a = 1; a < m; ++a)
+		{
+			uint8_t key_node = f.node[a];
+			int key_extra_dist = f.cost[a];
+			int b = a - 1;
+			while (b >= 0 && f.cost[b] > key_extra_dist)
 			{
-				int next = candidates[k];
-				_path.push(next);
-
-				if (_path.distance() < best)
-				{
-					// pruning
-					solve();
-					best = currentBestDist();
-				}
+				f.node[b + 1] = f.node[b];
+				f.cost[b + 1] = f.cost[b];
+				--b;
+			}
+			f.node[b + 1] = key_node;
+			f.cost[b + 1] = key_extra_dist;
+		}
+		f.cursor = 0;
+		f.count = (uint8_t)m;
+	}
 
-				_path.pop();
+	// Sort a frame by the key of the ordering policy instead of the cost alone. Kept
+	// out of the kernels, which stay as small as without portfolio.
+	[[gnu::noinline]] void reorder(Frame &f) const
+	{
+		const TSPGraph &g = _path.graph();
+		const int tail = _path.tail();
+		const int n = _path.full();
+		int64_t key[TSPPath::MAX_GRAPH];
+		uint64_t h = _ordering->seed ^ (uint64_t)_path.visited() * 0x9E3779B97F4A7C15ull ^ (uint64_t)tail << 40;
+		for (int k = 0; k < f.count; ++k)
+		{
+			const int i = f.node[k];
+			switch (_ordering->order)
+			{
+			case TSPOrdering::REGRET:
+			{
+				// Cost now minus the cheapest way to reach the city later
+				int later = INT_MAX;
+				for (int j = 0; j < f.count; ++j)
+					if (j != k)
+						later = std::min(later, g.distance(f.node[j], i));
+				key[k] = (int64_t)f.cost[k] - (later == INT_MAX ? 0 : later);
+				break;
+			}
+			case TSPOrdering::FARTHEST:
+			{
+				// Rank distance in the reference tour, then cost
+				int gap = std::abs(_ordering->position[i] - _ordering->position[tail]);
+				key[k] = ((int64_t)std::min(gap, n - gap) << 32) + f.cost[k];
+				break;
+			}
+			case TSPOrdering::RANDOM:
+			{
+				// splitmix64 of the prefix, the seed and the candidate
+				uint64_t z = (h += 0x9E3779B97F4A7C15ull);
+				z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+				z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+				z ^= z >> 31;
+				key[k] = (int64_t)f.cost[k] * 4 + (int64_t)(z % ((uint64_t)f.cost[k] + 1));
+				break;
+			}
+			default:
+				key[k] = f.cost[k];
 			}
 		}
+		for (int a = 1; a < f.count; ++a)
+			for (int b = a; b > 0 && key[b - 1] > key[b]; --b)
+			{
+				std::swap(key[b - 1], key[b]);
+				std::swap(f.node[b - 1], f.node[b]);
+				std::swap(f.cost[b - 1], f.cost[b]);
+			}
 	}
 
-	void write(std::ostream &os) const override
+	void flushStats(long nodes, long stale)
 	{
-		std::cout << "Task" << _path;
+		_context->_nodes.fetch_add(nodes, std::memory_order_relaxed);
+		if (stale)
+			_context->_stale_nodes.fetch_add(stale, std::memory_order_relaxed);
+	}
+
+	// The path holds every city: close the loop and publish it if it is the best one.
+	// Returns the best distance known after the publication.
+	int closeLoop()
+	{
+		_path.push(TSPPath::FIRST_NODE); // close the visiting loop
+		const int d = _path.distance();
+		int best = _context->_best_dist.load(std::memory_order_acquire);
+		if (d < best)
+		{
+			std::lock_guard<std::mutex> lock(_context->_best_mutex);
+			best = _context->_best_dist.load(std::memory_order_relaxed);
+			if (d < best)
+			{
+				_context->_best = _path;
+				_context->_best_dist.store(d, std::memory_order_release);
+				if (_ordering)
+					_ordering->publish(d);
+				best = d;
+			}
+		}
+		_path.pop();
+		return best;
 	}
 
-	static int currentBestDist()
+	friend class TSPContext;
+	template <int... I>
+	static TSPContext::Kernel kernelFor(int n, std::integer_sequence<int, I...>)
 	{
-		TSPPath *p = _best.load(std::memory_order_acquire);
-		return p ? p->distance() : INT_MAX;
+		static const TSPContext::Kernel kernels[] = {&TSPTask::search<MIN_KERNEL + I>...};
+		return kernels[n - MIN_KERNEL];
 	}
 };
 
-TSPGraph *TSPPath::_graph;
-// int TSPTask::_cutoff_size = INT_MAX;
-// TSPPath TSPTask::_shortest;
-// std::vector<TSPTask *> TSPTask::_free_list;
-inline std::atomic<TSPPath *> TSPTask::_best{nullptr};
+inline TSPContext::TSPContext(const TSPGraph *graph) : _graph(graph)
+{
+	if (_graph->size() > TSPPath::MAX_GRAPH)
+		throw std::runtime_error("Graph bigger than MAX_GRAPH");
+	selectKernel(_graph->size());
+}
+
+inline bool TSPContext::selectKernel(int n)
+{
+	if (n < TSPTask::MIN_KERNEL || n > TSPTask::MAX_KERNEL)
+	{
+		_kernel = &TSPTask::search<0>;
+		return false;
+	}
+	_kernel = TSPTask::kernelFor(n, std::make_integer_sequence<int, TSPTask::MAX_KERNEL - TSPTask::MIN_KERNEL + 1>{});
+	return true;
+}
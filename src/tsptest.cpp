@@ -0,0 +1,438 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <deque>
+#include <memory>
+#include <functional>
+#include <climits>
+
+#include "tsptask.hpp"
+#include "workstealing.hpp"
+#include "tspinline.hpp"
+#include "tspautotune.hpp"
+#include "tspreduce.hpp"
+#include "tspheuristic.hpp"
+#include "tspservice.hpp"
+#include "tspportfolio.hpp"
+#include "tspgenerator.hpp"
+
+// Checks of the solvers (make test):
+//  - optimality: every engine and thread count solves small instances, the tour has to
+//    visit every city once and be as short as the Held-Karp dynamic programming optimum
+//    (the heuristic engine only has to give a valid tour);
+//  - regression: the single-thread search of fixed instances is deterministic, its node
+//    count is compared with a baseline file and fails beyond the threshold. Times depend
+//    on the machine: they are only compared with --time, against a baseline recorded on
+//    the same machine (make timebaseline).
+// One line per failure, then a summary line. The exit status is 1 when a check fails.
+
+static int usage(const char *program)
+{
+	std::cerr << "Usage: " << program << " <cities-files-examples directory> [options]\n"
+			  << "  --baseline=FILE  node counts (and times) to compare with (default none)\n"
+			  << "  --update         write the baseline file from this run instead, with the\n"
+			  << "                   times when --time is given\n"
+			  << "  --nodes=R        node count regression allowed, as a ratio (default 0)\n"
+			  << "  --time[=R]       also check the times, regression allowed as a ratio\n"
+			  << "                   (default 0.5)\n"
+			  << "  --quick          skip the optimality checks\n";
+	return 1;
+}
+
+struct Solution
+{
+	std::vector<int> tour; // from city 0 back to it
+	long distance;
+};
+
+// Optimum by dynamic programming over the subsets of the cities but the first one:
+// best[S][j] is the shortest path from city 0 through S ending at city j
+static long heldKarp(const TSPGraph &g)
+{
+	const int m = g.size() - 1;
+	if (m < 1)
+		return 0;
+	std::vector<int> best((size_t)m << m, INT_MAX);
+	for (int j = 0; j < m; j++)
+		best[((size_t)1 << j) * m + j] = g.distance(0, j + 1);
+	for (uint32_t s = 1; s < (1u << m); s++)
+		for (int j = 0; j < m; j++)
+		{
+			const int d = best[(size_t)s * m + j];
+			if (d == INT_MAX || !(s >> j & 1))
+				continue;
+			for (int k = 0; k < m; k++)
+			{
+				if (s >> k & 1)
+					continue;
+				int &next = best[(size_t)(s | 1u << k) * m + k];
+				next = std::min(next, d + g.distance(j + 1, k + 1));
+			}
+		}
+	long optimum = LONG_MAX;
+	const size_t all = (1u << m) - 1;
+	for (int j = 0; j < m; j++)
+		optimum = std::min(optimum, (long)best[all * m + j] + g.distance(j + 1, 0));
+	return optimum;
+}
+
+// Empty when the tour is valid, the problem otherwise
+static std::string invalid(const TSPGraph &g, const Solution &s)
+{
+	const int n = g.size();
+	if ((int)s.tour.size() != n + 1 || s.tour.front() != 0 || s.tour.back() != 0)
+		return "not a closed tour of every city";
+	std::vector<bool> seen(n);
+	long length = 0;
+	for (int i = 0; i < n; i++)
+	{
+		if (s.tour[i] < 0 || s.tour[i] >= n || seen[s.tour[i]])
+			return "city missing or visited twice";
+		seen[s.tour[i]] = true;
+		length += g.distance(s.tour[i], s.tour[i + 1]);
+	}
+	if (length != s.distance)
+		return "length " + std::to_string(length) + " reported as " + std::to_string(s.distance);
+	return "";
+}
+
+static Solution solution(const TSPPath &path)
+{
+	Solution s;
+	for (int i = 0; i < path.size(); i++)
+		s.tour.push_back(path.node(i));
+	s.distance = path.size() ? path.distance() : -1;
+	return s;
+}
+
+// The engines of tsp and of the service, with the options changing the search
+using Engine = std::function<Solution(const TSPGraph &, unsigned threads)>;
+
+static Solution inlineEngine(const TSPGraph &g, unsigned threads, bool tune, bool tt, bool reduce)
+{
+	TSPContext context(&g);
+	std::unique_ptr<TSPTranspositionTable> table;
+	if (tt)
+	{
+		table.reset(new TSPTranspositionTable(1 << 20, 4, g.size() - 2));
+		context.setTable(table.get());
+	}
+	TSPCandidates candidates;
+	if (reduce)
+	{
+		TSPEdgeReducer::reduce(g, candidates);
+		context.setCandidates(&candidates);
+	}
+	size_t budget = threads * 16;
+	int cutoff = g.size();
+	if (tune)
+	{
+		TSPTuning t = TSPAutoTuner::tune(context, threads);
+		budget = t.budget;
+		cutoff = t.cutoff_size;
+	}
+	TSPInlineRunner runner(threads, budget, 1 << 16, TSPPrefixOps(&context, cutoff));
+	runner.setDynamicSplitting(tune);
+	runner.run(context.root().prefix());
+	return solution(context.result());
+}
+
+// The owner of a deque pops back what it pushed, last first, and thieves take the
+// oldest, also when the ring wraps around. Empty when right, the problem otherwise.
+static std::string dequeProblem()
+{
+	WorkStealingDeque<long> deque(5);
+	std::deque<long> model;
+	long next = 0, v;
+	for (int round = 0; round < 50; round++)
+	{
+		for (int i = 0; i < 3; i++)
+			if (deque.pushBottom(next))
+				model.push_back(next++);
+		if (deque.steal(v))
+		{
+			if (v != model.front())
+				return "steal got " + std::to_string(v) + ", expected " + std::to_string(model.front());
+			model.pop_front();
+		}
+		if (!deque.popBottom(v) || v != model.back())
+			return "popBottom got " + std::to_string(v) + ", expected " + std::to_string(model.back());
+		model.pop_back();
+	}
+	return "";
+}
+
+// One worker with a split budget above 1: it pops back from its own deque every prefix
+// it pushed (regression: popBottom once read the wrong slot and missed the optimum)
+static Solution ownDequeEngine(const TSPGraph &g, size_t budget)
+{
+	TSPContext context(&g);
+	TSPInlineRunner runner(1, budget, 1 << 16, TSPPrefixOps(&context));
+	runner.run(context.root().prefix());
+	return solution(context.result());
+}
+
+static Solution taskEngine(const TSPGraph &g, unsigned threads, bool tune)
+{
+	TSPContext context(&g);
+	size_t budget = threads * 16;
+	int cutoff = g.size();
+	if (tune)
+	{
+		TSPTuning t = TSPAutoTuner::tune(context, threads);
+		budget = t.budget;
+		cutoff = t.cutoff_size;
+	}
+	TSPTask root(&context, cutoff);
+	WorkStealingRunner runner(threads, budget, 1 << 16);
+	runner.setDynamicSplitting(tune);
+	runner.run(&root);
+	return solution(context.result());
+}
+
+static Solution directEngine(const TSPGraph &g, unsigned)
+{
+	TSPContext context(&g);
+	TSPTask root(&context);
+	DirectTaskRunner runner;
+	runner.run(&root);
+	return solution(context.result());
+}
+
+static Solution serviceEngine(const TSPGraph &g, unsigned threads, bool reduce)
+{
+	TSPService service(threads, reduce);
+	// Two requests at once on the pool, each one has to find its own optimum
+	std::shared_ptr<const TSPGraph> graph(&g, [](const TSPGraph *) {});
+	auto other = std::async(std::launch::async, [&]
+							{ return service.solve(graph, 0); });
+	TSPService::Result r = service.solve(graph, 0);
+	if (other.get().distance != r.distance)
+		return {{}, -1};
+	Solution s;
+	s.distance = r.distance;
+	std::istringstream in(r.path); // [distance: 0, a, b, ..., 0]
+	char c;
+	long d;
+	in >> c >> d >> c;
+	for (int city; in >> city; in >> c)
+		s.tour.push_back(city);
+	return s;
+}
+
+static Solution portfolioEngine(const TSPGraph &g, unsigned threads)
+{
+	TSPContext context(&g);
+	TSPPortfolio portfolio(context, threads, {TSPOrdering::RANDOM, TSPOrdering::REGRET, TSPOrdering::FARTHEST, TSPOrdering::NEAREST});
+	portfolio.run();
+	return solution(context.result());
+}
+
+static Solution heuristicEngine(const TSPGraph &g, unsigned threads)
+{
+	TSPHeuristicSolver solver(g, threads, g.size());
+	solver.run();
+	Solution s;
+	const std::vector<int> &tour = solver.tour();
+	const int start = (int)(std::find(tour.begin(), tour.end(), 0) - tour.begin());
+	for (int i = 0; i <= (int)tour.size(); i++)
+		s.tour.push_back(tour[(start + i) % tour.size()]);
+	s.distance = solver.length();
+	return s;
+}
+
+// Seeded instances, the ones tspgen writes: uniform, and a lattice with noise (many ties)
+static std::unique_ptr<TSPGraph> generated(const std::string &kind, int n, unsigned seed)
+{
+	return TSPGenerator(kind, n, seed).graph();
+}
+
+struct Baseline
+{
+	long nodes;
+	double time; // -1 when not recorded
+};
+
+int main(int argc, char **argv)
+{
+	std::map<std::string, std::string> options;
+	std::vector<char *> positional;
+	for (int i = 0; i < argc; i++)
+	{
+		std::string arg = argv[i];
+		if (i > 0 && arg.rfind("--", 0) == 0)
+		{
+			size_t eq = arg.find('=');
+			options[arg.substr(2, eq == std::string::npos ? std::string::npos : eq - 2)] =
+				eq == std::string::npos ? "" : arg.substr(eq + 1);
+		}
+		else
+			positional.push_back(argv[i]);
+	}
+	for (auto &option : options)
+		if (option.first != "baseline" && option.first != "update" && option.first != "nodes" &&
+			option.first != "time" && option.first != "quick")
+			return usage(argv[0]);
+	if (positional.size() != 2 || (options.count("update") && !options.count("baseline")))
+		return usage(argv[0]);
+	const std::string examples = positional[1];
+	const double node_threshold = options.count("nodes") ? std::atof(options["nodes"].c_str()) : 0;
+	const bool timed = options.count("time");
+	const double time_threshold = timed && !options["time"].empty() ? std::atof(options["time"].c_str()) : 0.5;
+
+	TSPGraph dj38(examples + "/dj38.tsp");
+	std::vector<std::unique_ptr<TSPGraph>> graphs;
+	long checks = 0, failures = 0;
+	auto fail = [&](const std::string &what)
+	{
+		std::cout << "FAIL;" << what << std::endl; // shown even if a later check crashes
+		failures++;
+	};
+
+	checks++;
+	const std::string deque = dequeProblem();
+	if (!deque.empty())
+		fail("deque;" + deque);
+
+	if (!options.count("quick"))
+	{
+		for (int size : {5, 8, 10, 12})
+			graphs.emplace_back(new TSPGraph(dj38, size));
+		graphs.push_back(generated("uniform", 10, 1));
+		graphs.push_back(generated("uniform", 12, 2));
+		graphs.push_back(generated("grid", 9, 3));
+		graphs.push_back(generated("grid", 11, 4));
+
+		const std::vector<std::pair<std::string, Engine>> engines = {
+			{"inline", [](const TSPGraph &g, unsigned t)
+			 { return inlineEngine(g, t, false, false, false); }},
+			{"inline-auto", [](const TSPGraph &g, unsigned t)
+			 { return inlineEngine(g, t, true, false, false); }},
+			{"inline-tt", [](const TSPGraph &g, unsigned t)
+			 { return inlineEngine(g, t, false, true, false); }},
+			{"inline-auto-tt-reduce", [](const TSPGraph &g, unsigned t)
+			 { return inlineEngine(g, t, true, true, true); }},
+			{"task", [](const TSPGraph &g, unsigned t)
+			 { return taskEngine(g, t, false); }},
+			{"task-auto", [](const TSPGraph &g, unsigned t)
+			 { return taskEngine(g, t, true); }},
+			{"portfolio", portfolioEngine},
+			{"service", [](const TSPGraph &g, unsigned t)
+			 { return serviceEngine(g, t, false); }},
+			{"service-reduce", [](const TSPGraph &g, unsigned t)
+			 { return serviceEngine(g, t, true); }},
+		};
+		for (auto &g : graphs)
+		{
+			const long optimum = heldKarp(*g);
+			auto check = [&](const std::string &engine, unsigned threads, const Solution &s, bool exact)
+			{
+				checks++;
+				std::ostringstream what;
+				what << g->filename() << ';' << g->size() << ';' << engine << ';' << threads << ';';
+				std::string problem = invalid(*g, s);
+				if (!problem.empty())
+					fail(what.str() + problem);
+				else if (exact ? s.distance != optimum : s.distance < optimum)
+					fail(what.str() + "length " + std::to_string(s.distance) + ", optimum " + std::to_string(optimum));
+			};
+			check("direct", 1, directEngine(*g, 1), true);
+			for (size_t budget : {2, 64})
+				check("own-deque-" + std::to_string(budget), 1, ownDequeEngine(*g, budget), true);
+			for (unsigned threads : {1u, 2u, 3u, 4u, 8u})
+			{
+				for (auto &engine : engines)
+					check(engine.first, threads, engine.second(*g, threads), true);
+				check("heuristic", threads, heuristicEngine(*g, threads), false);
+			}
+		}
+	}
+
+	// Regression: one thread, no splitting, best time of a few runs
+	std::map<std::string, Baseline> baseline;
+	if (options.count("baseline") && !options.count("update"))
+	{
+		std::ifstream in(options["baseline"]);
+		std::string line;
+		while (std::getline(in, line))
+		{
+			std::istringstream fields(line);
+			std::string name, nodes, time;
+			if (line.empty() || line[0] == '#' || !std::getline(fields, name, ';') ||
+				!std::getline(fields, nodes, ';'))
+				continue;
+			baseline[name] = {std::atol(nodes.c_str()), std::getline(fields, time, ';') ? std::atof(time.c_str()) : -1};
+		}
+		if (baseline.empty())
+			fail("baseline " + options["baseline"] + " missing or empty");
+	}
+	std::ostringstream measured;
+	measured << (timed ? "# instance;nodes;time, one thread (tsptest --update --time)\n"
+					   : "# instance;nodes, one thread (tsptest --update)\n");
+	graphs.clear();
+	for (int size : {13, 14})
+		graphs.emplace_back(new TSPGraph(dj38, size));
+	graphs.push_back(generated("uniform", 13, 5));
+	graphs.push_back(generated("grid", 12, 6));
+	for (auto &g : graphs)
+	{
+		std::string name = g->filename(); // dj38:13 whatever the directory
+		name = name.substr(name.find_last_of('/') + 1);
+		name = name.substr(0, name.rfind(".tsp")) + ':' + std::to_string(g->size());
+		long nodes = -1;
+		double time = 1e300;
+		for (int run = 0; run < 3; run++)
+		{
+			TSPContext context(g.get());
+			TSPInlineRunner runner(1, 1, 1 << 16, TSPPrefixOps(&context));
+			runner.run(context.root().prefix());
+			checks++;
+			if (nodes >= 0 && context.nodes() != nodes)
+				fail(name + ";nodes differ between runs: " + std::to_string(nodes) + ", " + std::to_string(context.nodes()));
+			nodes = context.nodes();
+			time = std::min(time, runner.duration());
+		}
+		measured << name << ';' << nodes;
+		if (timed)
+			measured << ';' << time;
+		measured << '\n';
+		auto it = baseline.find(name);
+		std::cout << "bench;" << name << ";nodes=" << nodes << ";time=" << time;
+		if (it != baseline.end())
+		{
+			std::cout << ";baseline_nodes=" << it->second.nodes;
+			if (it->second.time >= 0)
+				std::cout << ";baseline_time=" << it->second.time;
+		}
+		std::cout << '\n';
+		if (it != baseline.end())
+		{
+			checks++;
+			if (nodes > it->second.nodes * (1 + node_threshold))
+				fail(name + ";nodes " + std::to_string(nodes) + ", baseline " + std::to_string(it->second.nodes));
+			if (timed)
+			{
+				checks++;
+				if (it->second.time < 0)
+					fail(name + ";no time in the baseline");
+				else if (time > it->second.time * (1 + time_threshold))
+					fail(name + ";time " + std::to_string(time) + ", baseline " + std::to_string(it->second.time));
+			}
+		}
+		else if (!baseline.empty())
+			fail(name + ";not in the baseline");
+	}
+	if (options.count("update"))
+	{
+		std::ofstream out(options["baseline"]);
+		out << measured.str();
+		if (!out)
+			fail("cannot write " + options["baseline"]);
+	}
+
+	std::cout << "test;checks=" << checks << ";failures=" << failures << '\n';
+	return failures ? 1 : 0;
+}
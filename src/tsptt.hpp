@@ -0,0 +1,123 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <algorithm>
+
+// Concurrent fixed-size table of the best distance known for a search state
+// (visited cities, tail city). A prefix reaching a state at a distance not lower
+// than the stored one is dominated: every completion of it is at least as long.
+//
+// Each entry is one 64-bit word, key (37 bits) and distance (27 bits), updated with
+// single atomic stores or CAS. A bucket is one cache line of 8 entries; a new state
+// takes an empty entry or replaces the deepest one, so the shallow states, whose
+// subtrees are the biggest, stay in the table.
+class TSPTranspositionTable
+{
+public:
+	enum Result
+	{
+		MISS,  // state not in the table (now stored if there was room)
+		HIT,   // state found, this prefix is better and replaces the stored distance
+		PRUNE, // state found with a distance not higher: the prefix is dominated
+	};
+
+	static const int DISTANCE_BITS = 27;
+
+	TSPTranspositionTable(size_t bytes, int min_size, int max_size)
+		: _min_size(min_size), _max_size(max_size)
+	{
+		size_t buckets = 1;
+		while (buckets * 2 * sizeof(Bucket) <= bytes)
+			buckets *= 2;
+		_mask = buckets - 1;
+		_buckets.reset(new Bucket[buckets]);
+		clear();
+	}
+
+	void clear()
+	{
+		for (size_t b = 0; b <= _mask; b++)
+			for (auto &e : _buckets[b].entries)
+				e.store(0, std::memory_order_relaxed);
+		_lookups.store(0, std::memory_order_relaxed);
+		_hits.store(0, std::memory_order_relaxed);
+		_prunes.store(0, std::memory_order_relaxed);
+	}
+
+	// The table is only used for paths of size [min_size, max_size]
+	bool covers(int path_size) const { return path_size >= _min_size && path_size <= _max_size; }
+
+	Result admit(uint32_t visited, int tail, int distance)
+	{
+		if (distance >= (1 << DISTANCE_BITS))
+			return MISS; // cannot be stored
+		const uint64_t key = ((uint64_t)visited << 5) | (uint64_t)tail;
+		const uint64_t entry = (key << DISTANCE_BITS) | (uint64_t)distance;
+		Bucket &bucket = _buckets[(key * 0x9E3779B97F4A7C15ull >> 20) & _mask];
+
+		const int depth = __builtin_popcount(visited);
+		int victim = -1;
+		int victim_depth = -1;
+		for (int i = 0; i < Bucket::ENTRIES; i++)
+		{
+			uint64_t e = bucket.entries[i].load(std::memory_order_relaxed);
+			if (e == 0) // empty, the best victim
+			{
+				if (victim_depth < INT32_MAX)
+				{
+					victim = i;
+					victim_depth = INT32_MAX;
+				}
+				continue;
+			}
+			if ((e >> DISTANCE_BITS) == key)
+			{
+				if ((int)(e & DISTANCE_MASK) <= distance)
+					return PRUNE;
+				bucket.entries[i].compare_exchange_strong(e, entry, std::memory_order_relaxed);
+				return HIT;
+			}
+			int d = __builtin_popcount((uint32_t)(e >> (DISTANCE_BITS + 5)));
+			if (d > victim_depth)
+			{
+				victim = i;
+				victim_depth = d;
+			}
+		}
+		if (victim_depth >= depth)
+			bucket.entries[victim].store(entry, std::memory_order_relaxed);
+		return MISS;
+	}
+
+	// Counters kept by the searches, flushed once per search() call
+	void count(long lookups, long hits, long prunes)
+	{
+		_lookups.fetch_add(lookups, std::memory_order_relaxed);
+		_hits.fetch_add(hits, std::memory_order_relaxed);
+		_prunes.fetch_add(prunes, std::memory_order_relaxed);
+	}
+
+	long lookups() const { return _lookups.load(std::memory_order_relaxed); }
+	long hits() const { return _hits.load(std::memory_order_relaxed); }
+	long prunes() const { return _prunes.load(std::memory_order_relaxed); }
+	size_t entries() const { return (_mask + 1) * Bucket::ENTRIES; }
+	size_t bytes() const { return (_mask + 1) * sizeof(Bucket); }
+	int minSize() const { return _min_size; }
+	int maxSize() const { return _max_size; }
+
+private:
+	static const uint64_t DISTANCE_MASK = (1ull << DISTANCE_BITS) - 1;
+
+	struct alignas(64) Bucket
+	{
+		static const int ENTRIES = 8;
+		std::atomic<uint64_t> entries[ENTRIES];
+	};
+
+	std::unique_ptr<Bucket[]> _buckets;
+	size_t _mask;
+	int _min_size, _max_size;
+	std::atomic<long> _lookups{0}, _hits{0}, _prunes{0};
+};
@@ -1,39 +1,26 @@
 #pragma once
 
 #include <vector>
+#include <atomic>
+#include <memory>
 #include <thread>
 #include <random>
+#include <chrono>
+#include <algorithm>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
 
 #include "task.hpp"
+#include "perfcounters.hpp"
 
-class SimpleTaskCollection : public TaskCollection
-{
-private:
-    std::vector<Task *> _data;
-
-public:
-    int size() const override { return static_cast<int>(_data.size()); }
-    Task *operator[](int i) override { return _data[static_cast<size_t>(i)]; }
-    void push(Task *t) override { _data.push_back(t); }
-    Task *pop() override
-    {
-        if (_data.empty())
-            return nullptr;
-        Task *t = _data.back();
-        _data.pop_back();
-        return t;
-    }
-    void clear() override
-    {
-        _data.clear();
-    }
-};
-
+// Chase-Lev deque of T values (pointers or small trivially copyable values)
+template <typename T>
 class WorkStealingDeque
 {
 public:
     explicit WorkStealingDeque(long capacity = 4096) : _capacity(capacity),
-                                                       _tasks(new Task *[capacity]), _top(0), _bottom(0)
+                                                       _tasks(new T[capacity]), _top(0), _bottom(0)
     {
     }
 
@@ -47,7 +34,7 @@ public:
     WorkStealingDeque &operator=(const WorkStealingDeque &) = delete;
 
     // pushBottom: called only by the owning thread of this deque
-    bool pushBottom(Task *task)
+    bool pushBottom(const T &task)
     {
         long bottom = _bottom.load(std::memory_order_relaxed);
         long top = _top.load(std::memory_order_acquire);
@@ -62,7 +49,7 @@ public:
     }
 
     // popBottom : called only by the owning thread of this deque
-    bool popBottom(Task *&result)
+    bool popBottom(T &result)
     {
         long bottom = _bottom.load(std::memory_order_relaxed) - 1;
         _bottom.store(bottom, std::memory_order_relaxed);
@@ -70,7 +57,8 @@ public:
         long top = _top.load(std::memory_order_relaxed);
         if (top <= bottom)
         {
-            result = _tasks[bottom & _capacity];
+            bool taken = true;
+            result = _tasks[bottom % _capacity];
             if (top == bottom) // If this is the last task in the dequeu, there is a possible race with a thief (voleur)
             {
                 long expected = top;
@@ -79,22 +67,31 @@ public:
                         std::memory_order_seq_cst,
                         std::memory_order_relaxed))
                 {
-                    result = nullptr; // Stolen by another thread
+                    taken = false; // Stolen by another thread
                 }
                 _bottom.store(bottom + 1, std::memory_order_relaxed); // restore
             }
-            return result != nullptr;
+            return taken;
         }
         else
         {
             _bottom.store(bottom + 1, std::memory_order_relaxed); // restore
-            result = nullptr;
             return false;
         }
     }
 
+    // Approximate, exact only for the owning thread when nobody steals
+    bool empty() const
+    {
+        return _bottom.load(std::memory_order_relaxed) <= _top.load(std::memory_order_relaxed);
+    }
+    long size() const
+    {
+        return std::max(0L, _bottom.load(std::memory_order_relaxed) - _top.load(std::memory_order_relaxed));
+    }
+
     // steal : called by other threads
-    bool steal(Task *&result)
+    bool steal(T &result)
     {
         long top = _top.load(std::memory_order_acquire);
         std::atomic_thread_fence(std::memory_order_seq_cst);
@@ -104,38 +101,82 @@ public:
         {
             result = _tasks[top % _capacity];
             long expected = top;
-            if (!_top.compare_exchange_strong(
-                    expected, top + 1,
-                    std::memory_order_seq_cst,
-                    std::memory_order_relaxed))
-            {
-                result = nullptr;
-                return false;
-            }
-            return true;
+            return _top.compare_exchange_strong(
+                expected, top + 1,
+                std::memory_order_seq_cst,
+                std::memory_order_relaxed);
         }
-        result = nullptr;
         return false;
     }
 
 private:
     const long _capacity;
-    Task **_tasks;
+    T *_tasks;
     std::atomic<long> _top;
     std::atomic<long> _bottom; // Increase when deque is growing
 };
 
-class WorkStealingRunner : public TaskRunner
+// Work-stealing engine over task values of type T, stored inline in the deques:
+// push and steal copy a T, so that a small trivially copyable T needs no allocation
+// and no virtual call. What a task does is given by Ops, which must provide
+//     template <typename Worker> void execute(T &task, Worker &worker);
+// splitting the task with worker.spawn() or solving it. The run ends when every
+// spawned task has been executed.
+//
+// Pool mode (start/submit/shutdown) keeps the threads alive between roots submitted
+// by other threads, several roots being in progress at once. Splitting budgets are
+// then left to Ops, per root.
+template <typename T, typename Ops>
+class BasicWorkStealingRunner : public RunTimer
 {
 public:
-    WorkStealingRunner(unsigned num_threads,
-                       size_t max_initial_tasks,
-                       long deque_capacity = 1 << 20)
-        : _num_threads(num_threads),
+    // Dynamic splitting: tasks run by slices lasting about SLICE_TIME seconds, and
+    // between two slices a task gives work away when some workers are idle
+    static constexpr double SLICE_TIME = 200e-6;
+    static const long MIN_SLICE = 64;
+    static const long MAX_SLICE = 1L << 24;
+    // Pool mode: a worker between two slices runs a waiting root and its children
+    // before resuming, to this nesting depth at most
+    static const int MAX_NESTING = 4;
+
+    // Handle on the calling worker given to Ops::execute
+    class Worker
+    {
+    public:
+        unsigned id() const { return _id; }
+
+        // Push a new task into the deque of this worker
+        void spawn(const T &task) { _runner->spawn(task, _id); }
+
+        // True until the split budget is reached, split() accounts the children of a split
+        bool splitting() const { return _runner->_splitting.load(std::memory_order_relaxed); }
+        void split(int n) { _runner->split(n); }
+
+        // Run a task by slices (resume(budget) returns true when done), giving work away
+        // between two slices (donate(T &) returns false when nothing is left to give)
+        bool dynamic() const { return _runner->_dynamic; }
+        template <typename Resume, typename Donate>
+        void sliced(Resume resume, Donate donate) { _runner->sliced(resume, donate, _id); }
+
+    private:
+        friend class BasicWorkStealingRunner;
+        Worker(BasicWorkStealingRunner *runner, unsigned id) : _runner(runner), _id(id) {}
+        BasicWorkStealingRunner *_runner;
+        unsigned _id;
+    };
+
+    BasicWorkStealingRunner(unsigned num_threads,
+                            size_t max_initial_tasks,
+                            long deque_capacity = 1 << 20,
+                            Ops ops = Ops())
+        : _ops(ops),
+          _num_threads(num_threads),
           _max_initial_tasks(max_initial_tasks),
           _deques(num_threads),
           _threads(),
           _tasks_remaining(0),
+          _tasks_created(0),
+          _splitting(false),
           _stop(false)
     {
         if (_num_threads == 0)
@@ -145,207 +186,399 @@ public:
             _max_initial_tasks = 1;
 
         // Create a WorkStealingDeque foreach thread and a random generator
+        _deques.resize(_num_threads);
+        _workers.resize(_num_threads);
         for (unsigned i = 0; i < _num_threads; ++i)
         {
-            _deques[i] = std::make_unique<WorkStealingDeque>(deque_capacity);
+            _deques[i] = std::make_unique<WorkStealingDeque<T>>(deque_capacity);
             _rngs.emplace_back(std::random_device{}());
         }
     }
 
-    void run(Task *root) override
+    ~BasicWorkStealingRunner()
     {
-        // Filling the leaves array with all the task to distribute to the deques
-        std::vector<Task *> leaves;
-        partitionInitialTasks(root, leaves);
+        if (_persistent)
+            shutdown();
+    }
 
-        if (leaves.empty())
-        {
-            TaskRunner::startTimer();
-            root->solve();
-            TaskRunner::stopTimer();
-            return;
-        }
+    Ops &ops() { return _ops; }
 
-        _tasks_remaining.store(static_cast<long>(leaves.size()), std::memory_order_relaxed);
+    // The timer covers everything: the threads start on the root at once and split it
+    // cooperatively, each one pushing the children straight into its own deque.
+    void run(const T &root)
+    {
+        RunTimer::startTimer();
+        _tasks_remaining.store(1, std::memory_order_relaxed);
+        _tasks_created.store(1, std::memory_order_relaxed);
+        _splitting.store(_max_initial_tasks > 1, std::memory_order_relaxed);
         _stop.store(false, std::memory_order_relaxed);
+        _idle_workers.store(0, std::memory_order_relaxed);
+        for (auto &w : _workers)
+            w = WorkerState();
+        _deques[0]->pushBottom(root);
 
-        // Distribute the tasks in the deques using round-robin
-        for (size_t i = 0; i < leaves.size(); i++)
-        {
-            unsigned deque_idx = static_cast<unsigned>(i % _num_threads);
-            if (!_deques[deque_idx]->pushBottom(leaves[i]))
-            {
-                std::cerr << "The deque is full for the thread" << deque_idx << "\n";
-                std::abort();
-            }
-        }
         // Launch all threads
-        TaskRunner::startTimer();
         _threads.clear();
         _threads.reserve(_num_threads);
 
         for (unsigned i = 0; i < _num_threads; i++)
         {
-            _threads.emplace_back(&WorkStealingRunner::workerLoop, this, i);
+            _threads.emplace_back(&BasicWorkStealingRunner::workerLoop, this, i);
         }
 
         // Join all threads
         for (auto &th : _threads)
             th.join();
-        TaskRunner::stopTimer();
+        RunTimer::stopTimer();
+    }
 
-        // Free all the temporary sub tasks (root will be deleted by the caller)
-        for (Task *t : leaves)
+    // Start the threads of pool mode, they wait for submit()
+    void start()
+    {
+        _persistent = true;
+        _tasks_remaining.store(0, std::memory_order_relaxed);
+        _splitting.store(false, std::memory_order_relaxed);
+        _stop.store(false, std::memory_order_relaxed);
+        _threads.clear();
+        for (unsigned i = 0; i < _num_threads; i++)
+            _threads.emplace_back(&BasicWorkStealingRunner::workerLoop, this, i);
+    }
+
+    // Queue a root from any thread, it is taken by the next worker looking for work
+    // or between two slices of a running task (see sliced)
+    void submit(const T &root)
+    {
+        _tasks_remaining.fetch_add(1, std::memory_order_relaxed);
+        {
+            std::lock_guard<std::mutex> lock(_inbox_mutex);
+            _inbox.push_back(root);
+            _waiting.fetch_add(1, std::memory_order_release);
+        }
+        _wakeup.notify_all(); // every worker, to steal the children of the root
+    }
+
+    // Stop the threads of pool mode, to be called once every submitted root is done
+    void shutdown()
+    {
         {
-            if (t != root)
-                delete t;
+            std::lock_guard<std::mutex> lock(_inbox_mutex);
+            _stop.store(true, std::memory_order_release);
         }
+        _wakeup.notify_all();
+        for (auto &th : _threads)
+            th.join();
+        _threads.clear();
+        _persistent = false;
+    }
+
+    void setDynamicSplitting(bool dynamic) { _dynamic = dynamic; }
+
+    // Count the hardware events of every worker over its whole loop (see PerfCounters)
+    void setPerfCounters(bool enabled) { _perf = enabled; }
+
+    // Statistics of the last run
+    long donations() const { return sum(&WorkerState::donations); }
+    long stealFailures() const { return sum(&WorkerState::steal_failures); }
+    long sliceLength() const { return _num_threads ? sum(&WorkerState::slice) / _num_threads : 0; } // mean, in task units
+    // Summed over the workers, source NONE without setPerfCounters
+    PerfCounters::Counts perfCounts() const
+    {
+        PerfCounters::Counts total;
+        for (const WorkerState &w : _workers)
+            total += w.perf;
+        return total;
     }
 
 private:
+    // Written only by its worker, one cache line each
+    struct alignas(64) WorkerState
+    {
+        long slice = 1024;
+        long donations = 0;
+        long steal_failures = 0; // rounds of steal attempts that found nothing
+        int nesting = 0;         // roots run between two slices, see sliced
+        PerfCounters::Counts perf;
+    };
+
+    Ops _ops;
     unsigned _num_threads;
     size_t _max_initial_tasks; // budget
 
-    std::vector<std::unique_ptr<WorkStealingDeque>> _deques;
+    std::vector<std::unique_ptr<WorkStealingDeque<T>>> _deques;
     std::vector<std::thread> _threads;
     std::vector<std::mt19937_64> _rngs; // random generator used to choose which deque to steal. One generator per thread
 
     std::atomic<long> _tasks_remaining;
+    std::atomic<long> _tasks_created; // tasks created by splitting, splitting stops at the budget
+    std::atomic<bool> _splitting;     // false once the budget is exhausted
     std::atomic<bool> _stop;
 
-    void partitionInitialTasks(Task *root, std::vector<Task *> &leaves)
-    {
-        std::vector<Task *> current;
-        std::vector<Task *> next;
-        current.push_back(root); // add the root to the current task to split
-
-        const size_t budget = _max_initial_tasks;
-        SimpleTaskCollection children;
+    bool _dynamic = false;
+    bool _perf = false;
+    std::vector<WorkerState> _workers;
+    std::atomic<int> _idle_workers{0};
 
-        while (!current.empty())
-        {
-            next.clear();
-
-            for (size_t idx = 0; idx < current.size(); idx++)
-            {
-                Task *task = current[idx];
+    // Pool mode
+    bool _persistent = false;
+    std::mutex _inbox_mutex;
+    std::condition_variable _wakeup;
+    std::deque<T> _inbox;
+    std::atomic<int> _waiting{0}; // roots in _inbox
 
-                // Before splitting, we check whether the number of tasks is close to the budget.
-                if (leaves.size() + next.size() >= budget)
-                {
-                    // Push in leaves all the remaining current tasks
-                    for (size_t j = idx; j < current.size(); ++j)
-                    {
-                        leaves.push_back(current[j]);
-                    }
-
-                    // Insert all the taks in next in leaves
-                    leaves.insert(leaves.end(), next.begin(), next.end());
-                    return;
-                }
+    bool admit(T &root)
+    {
+        if (_waiting.load(std::memory_order_acquire) == 0)
+            return false;
+        std::lock_guard<std::mutex> lock(_inbox_mutex);
+        if (_inbox.empty())
+            return false;
+        root = _inbox.front();
+        _inbox.pop_front();
+        _waiting.fetch_sub(1, std::memory_order_relaxed);
+        return true;
+    }
 
-                children.clear();
-                int n = task->split(&children);
+    long sum(long WorkerState::*field) const
+    {
+        long total = 0;
+        for (const WorkerState &w : _workers)
+            total += w.*field;
+        return total;
+    }
 
-                // Split didn't work
-                if (n == 0)
-                {
-                    leaves.push_back(task);
-                    continue;
-                }
+    void spawn(const T &task, unsigned id)
+    {
+        // Announce the task before it can be stolen and finished
+        _tasks_remaining.fetch_add(1, std::memory_order_relaxed);
+        if (!_deques[id]->pushBottom(task))
+        {
+            T copy = task; // deque is full: do it now
+            execute(copy, id);
+        }
+    }
 
-                // Split is too large
-                if (leaves.size() + next.size() + (size_t)n > budget)
-                {
-                    for (int i = 0; i < n; i++)
-                    {
-                        delete children[i];
-                    }
-                    leaves.push_back(task);
-                    continue;
-                }
+    // The budget is reached: every remaining task will be solved. A split may modify
+    // its task (see IntVecSortTask), so the children are kept even past the budget.
+    void split(int n)
+    {
+        long created = _tasks_created.fetch_add(n - 1, std::memory_order_relaxed) + n - 1;
+        if (created >= static_cast<long>(_max_initial_tasks))
+            _splitting.store(false, std::memory_order_relaxed);
+    }
 
-                // Put splitted tasks in next
-                for (int i = 0; i < n; i++)
-                {
-                    next.push_back(children[i]);
-                }
+    // The slice length follows the measured speed of the task, and idle workers are
+    // fed with donated tasks between two slices
+    template <typename Resume, typename Donate>
+    void sliced(Resume &resume, Donate &donate, unsigned id)
+    {
+        WorkerState &state = _workers[id];
+        while (true)
+        {
+            auto start = std::chrono::steady_clock::now();
+            if (resume(state.slice))
+                return;
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            double ratio = SLICE_TIME / std::max(elapsed.count(), 1e-9);
+            long slice = static_cast<long>(state.slice * std::min(2.0, std::max(0.5, ratio)));
+            state.slice = std::min(MAX_SLICE, std::max(MIN_SLICE, slice));
+
+            // A waiting root goes before the rest of this task: run it and the children
+            // it pushed here, so that it does not wait for older roots to finish
+            T root;
+            if (state.nesting < MAX_NESTING && admit(root))
+            {
+                const long base = _deques[id]->size();
+                state.nesting++;
+                execute(root, id);
+                for (T child; _deques[id]->size() > base && _deques[id]->popBottom(child);)
+                    execute(child, id);
+                state.nesting--;
             }
 
-            if (next.empty())
+            // Idle workers can already steal from a non empty deque
+            if (!_deques[id]->empty())
+                continue;
+            for (int idle = _idle_workers.load(std::memory_order_relaxed); idle > 0; --idle)
             {
-                return; // done
+                T child;
+                if (!donate(child))
+                    break;
+                state.donations++;
+                spawn(child, id);
             }
-
-            current.swap(next);
         }
     }
 
+    // Execute a task, the last one stops the run
+    void execute(T &task, unsigned id)
+    {
+        Worker worker(this, id);
+        _ops.execute(task, worker);
+        if (_tasks_remaining.fetch_sub(1, std::memory_order_acq_rel) == 1 && !_persistent)
+            _stop.store(true, std::memory_order_release);
+    }
+
     void workerLoop(unsigned id)
     {
-        Task *task = nullptr;
+        T task;
         auto &rng = _rngs[id];
         std::uniform_int_distribution<unsigned> victim_dist(0, _num_threads - 1);
+        bool idle = false;
+        PerfCounters counters;
+        if (_perf)
+            counters.start();
 
-        while (true)
+        while (!_stop.load(std::memory_order_acquire))
         {
-            // Try taking a task in his own queue and solve it
-            if (_deques[id]->popBottom(task))
-            {
-                if (task)
-                {
-                    task->solve();
-                    task = nullptr;
-                    long remaining = _tasks_remaining.fetch_sub(1, std::memory_order_acq_rel) - 1;
-                    if (remaining == 0)
-                    {
-                        _stop.store(true, std::memory_order_release);
-                        break;
-                    }
-                    continue;
-                }
-            }
+            // Try taking a task in his own queue. While splitting, the oldest one is taken
+            // so that the tree is split breadth-first, then the newest one.
+            bool found = _splitting.load(std::memory_order_relaxed) ? _deques[id]->steal(task)
+                                                                    : _deques[id]->popBottom(task);
+            if (!found)
+                found = admit(task);
 
             // Try to randomly steal a task to another deque. (2 * _num_threads is arbitrary choosen)
-            bool stolen = false;
-            for (unsigned attempt = 0; attempt < _num_threads * 2; ++attempt)
+            for (unsigned attempt = 0; !found && attempt < _num_threads * 2; ++attempt)
             {
                 unsigned victim = victim_dist(rng); // choose a victim to try to steal
                 if (victim == id)
                     continue; // Do not steal your own deque
-                if (_deques[victim]->steal(task))
-                {
-                    stolen = true;
-                    break; // Break just this for loop
-                }
+                found = _deques[victim]->steal(task);
             }
 
-            // Solve the stolen task
-            if (stolen && task)
+            if (found)
             {
-                task->solve();
-                task = nullptr;
-                long remaining = _tasks_remaining.fetch_sub(1, std::memory_order_acq_rel) - 1;
-                if (remaining == 0)
+                if (idle)
                 {
-                    _stop.store(true, std::memory_order_release);
-                    break;
+                    idle = false;
+                    _idle_workers.fetch_sub(1, std::memory_order_relaxed);
                 }
+                execute(task, id);
                 continue;
             }
 
-            // No job found yet
-            if (_stop.load(std::memory_order_acquire))
-                break;
+            // No task found yet
+            _workers[id].steal_failures++;
+            if (!idle)
+            {
+                idle = true;
+                _idle_workers.fetch_add(1, std::memory_order_relaxed);
+            }
+            if (_persistent && _tasks_remaining.load(std::memory_order_acquire) == 0)
+            {
+                // Nothing in progress: sleep until the next root
+                std::unique_lock<std::mutex> lock(_inbox_mutex);
+                _wakeup.wait(lock, [this]
+                             { return _stop.load(std::memory_order_relaxed) || _tasks_remaining.load(std::memory_order_acquire) > 0; });
+            }
+            else
+                std::this_thread::yield();
+        }
+        if (_perf)
+            _workers[id].perf = counters.stop();
+    }
+};
+
+// Fork-join runner of polymorphic Tasks on the engine above: a task is either solved,
+// or split into children run in parallel and merged by the thread finishing the last
+// child. The children belong to the parent's merge(), which deletes them; the root
+// belongs to the caller.
+class WorkStealingRunner : public TaskRunner
+{
+private:
+    // A task with its continuation: the parent to notify once the task and all its
+    // children are done. pending counts the task itself plus its unfinished children.
+    struct Job
+    {
+        Task *task;
+        Job *parent;
+        std::atomic<int> pending;
+        SimpleTaskCollection children; // given to merge(), in creation order
+
+        Job(Task *t, Job *p) : task(t), parent(p), pending(1) {}
+    };
 
-            // Mark the end
-            if (_tasks_remaining.load(std::memory_order_acquire) == 0)
+    struct JobOps
+    {
+        template <typename Worker>
+        void execute(Job *job, Worker &worker)
+        {
+            if (worker.splitting())
             {
-                _stop.store(true, std::memory_order_release);
-                break;
+                SimpleTaskCollection children;
+                int n = job->task->split(&children);
+                if (n > 0)
+                {
+                    worker.split(n);
+                    for (int i = 0; i < n; i++)
+                        worker.spawn(child(job, children[i]));
+                    finish(job);
+                    return;
+                }
             }
+            if (worker.dynamic())
+                worker.sliced([job](long budget)
+                              { return job->task->resume(budget); },
+                              [job](Job *&donated)
+                              {
+                                  Task *t = job->task->donate();
+                                  if (t)
+                                      donated = child(job, t);
+                                  return t != nullptr;
+                              });
+            else
+                job->task->solve();
+            finish(job);
+        }
 
-            std::this_thread::yield();
+        static Job *child(Job *job, Task *task)
+        {
+            job->children.push(task);
+            job->pending.fetch_add(1, std::memory_order_relaxed);
+            return new Job(task, job);
+        }
+
+        // One part of the job is done (itself or a child): the last one merges the
+        // children and notifies the parent
+        static void finish(Job *job)
+        {
+            while (job && job->pending.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            {
+                if (job->children.size())
+                    job->task->merge(&job->children);
+                Job *parent = job->parent;
+                delete job;
+                job = parent;
+            }
         }
+    };
+
+    BasicWorkStealingRunner<Job *, JobOps> _engine;
+
+public:
+    static constexpr double SLICE_TIME = BasicWorkStealingRunner<Job *, JobOps>::SLICE_TIME;
+
+    WorkStealingRunner(unsigned num_threads,
+                       size_t max_initial_tasks,
+                       long deque_capacity = 1 << 20)
+        : _engine(num_threads, max_initial_tasks, deque_capacity)
+    {
+    }
+
+    void run(Task *root) override
+    {
+        TaskRunner::startTimer();
+        _engine.run(new Job(root, nullptr));
+        TaskRunner::stopTimer();
     }
-};
\ No newline at end of file
+
+    void setDynamicSplitting(bool dynamic) { _engine.setDynamicSplitting(dynamic); }
+
+    // Statistics of the last run
+    long donations() const { return _engine.donations(); }
+    long stealFailures() const { return _engine.stealFailures(); }
+    long sliceLength() const { return _engine.sliceLength(); }
+
+    void setPerfCounters(bool enabled) { _engine.setPerfCounters(enabled); }
+    PerfCounters::Counts perfCounts() const { return _engine.perfCounts(); }
+};